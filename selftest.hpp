@@ -44,6 +44,31 @@ These are several related facilities here:
     CHECKIFTHROWS( expr, except )
                     Checks that expression 'expr' throws an expected exception.
                     Used for unit testing error conditions
+    CHECK_NEAR( a, b, abs, rel )
+    CHECK_ULP( a, b, maxUlps )
+                    Tests that floating point values are close enough
+    CHECK_MATCHES_GOLDEN( buffer, path )
+                    Tests that output is the same as a saved golden file
+    CHECK_FOR_ALL( range, predicate )
+                    Tests that predicate is true for every input in range,
+                    spreading the work across all cores
+    CHECK_EQUIVALENT( fast, reference, generator, n )
+                    Tests that an optimized function gives the same results
+                    as a reference implementation and reports the speedup
+    PROPERTY_TEST( function, generator... )
+                    Registers and defines a unit test that must pass for
+                    many generated inputs
+    TEST_FUZZ( function, data, size )
+                    Registers and defines a fuzz target which is also a unit
+                    test replaying its saved corpus
+    TEST_FIXTURE( type, function )
+                    Defines expensive test input that is built once and
+                    shared by all tests
+    TEST_SUITE( suite, concurrency, resource... )
+                    Groups unit tests with shared setup and teardown, and
+                    says which tests may run at the same time
+    selftest::clock A steady clock running in virtual time so that time
+                    dependent code can be tested without waiting
 
 These facilities have options enabled or disabled by setting preprocessor 
 variables before the '#include "selftest.hpp"'
@@ -102,6 +127,52 @@ For use in a debugger, set a breakpoint on the function
     selftest::thrower() 
 to catch all these errors as they happen and before throwing.
 
+To see which caller was responsible when the throw is deep in shared code,
+in the file with SELFTEST_IMPLEMENTATION
+    #define STACKTRACES         <-- Thrown exceptions carry the stack
+before the '#include "selftest.hpp"'. The return addresses are saved when
+the exception is thrown, which is cheap, and are turned into names only
+when what() is first called or a unit test failure is printed. The stack
+of a caught exception is found with
+    dynamic_cast<const selftest::StackTrace*>( &e )
+Names are found only for exported functions (link with -rdynamic).
+
+
+Tracing throws
+--------------
+
+Exceptions thrown often, as control flow in a hot path for example, are
+slow. To find them, in the file with SELFTEST_IMPLEMENTATION
+    #define TRACETHROWS         <-- Count throws through selftest::thrower()
+    #define TRACEALLTHROWS      <-- and also every other C++ throw
+before the '#include "selftest.hpp"'. Throws are counted by type and throw
+site, and a stack is sampled on the 1st, 2nd, 4th, 8th... throw from each
+site. When the program exits a report of the sites, most frequent first,
+is written to std::cerr, with the sampled stacks of the top three.
+
+TRACEALLTHROWS replaces __cxa_throw(), so it works only with gcc or clang
+on a platform with dlsym( RTLD_NEXT ) (link with -ldl on older glibc), and
+names functions in stacks only if they are exported (link with -rdynamic).
+The report can also be had at any time from
+    selftest::ThrowTracer::global().report( std::cerr );
+
+
+Tracking allocations
+--------------------
+
+Allocations are often why one way of doing something is faster than
+another. In the file with SELFTEST_IMPLEMENTATION
+    #define TRACKALLOCATIONS    <-- Count what operator new allocates
+before the '#include "selftest.hpp"' replaces the global operators new and
+delete. Each thread's allocations, bytes allocated, live bytes and peak are
+had from selftest::allocationCounts(). Benchmarks then write the
+allocations and bytes per call, and the most allocated at once during a
+batch, under their times. They are saved in baselines, and a change from
+the baseline is shown. Only allocations while timed are counted, not those
+of setup or while paused, and only those by the benchmark's thread, though
+the peak includes what is allocated while paused. Aligned new is counted
+only where there is posix_memalign().
+
 
 Using Unit Test macros
 ----------------------
@@ -115,11 +186,92 @@ In unit test source files:
                     Prints a message on std::cerr if left!=right.
     CHECKIFTHROWS( stmt, except )
                     Test fails if stmt does not throw expected exception type
+    CHECK_NEAR( a, b, abs, rel )
+                    Test fails if a and b differ by more than abs and by more
+                    than rel times the larger magnitude
+    CHECK_ULP( a, b, maxUlps )
+                    Test fails if there are more than maxUlps representable
+                    values (of the type of a) between a and b
+    CHECK_ALL_NEAR( a, b, n, abs, rel )
+    CHECK_ALL_ULP( a, b, n, maxUlps )
+                    As above for each of the n elements of arrays a and b
+    CHECK_MATCHES_GOLDEN( buffer, path )
+                    Test fails if buffer differs from the contents of the
+                    file at path
+    CHECK_FOR_ALL( range, predicate )
+                    Test fails if predicate(x) is false for any x in range
+    CHECK_EQUIVALENT( fast, reference, generator, n )
+    CHECK_EQUIVALENT_CMP( fast, reference, generator, n, compare )
+                    Test fails if fast(x) and reference(x) differ for any of
+                    n generated inputs
+    PROPERTY_TEST( function, generator... )( parameters )
+    PROPERTY_TEST_N( function, n, generator... )( parameters )
+                    Registers and defines a unit test function that is called
+                    with n (default 1000) sets of generated arguments
+    TEST_FUZZ( function, data, size )
+                    Registers and defines a fuzz target, and the unit test
+                    function_corpus which calls it for each saved input
+    TEST_CONCURRENT( function, threads, n )( parameters )
+                    Registers and defines a unit test function that is called
+                    n times on each of threads threads, all at once
+    TEST_ASYNC( function )
+                    Registers and defines a unit test coroutine (C++20)
+    CHECK_LATENCY( expression, n, percentile <= duration... )
+                    Test fails if any of the percentiles of the time taken
+                    by n evaluations of expression is over its duration
+    BENCHMARK( function )( selftest::Benchmark& b )
+                    Registers and defines a benchmark, run with --benchmark
+    TEST_FIXTURE( type, function )
+                    Defines function() returning a const type& built by the
+                    body, once, the first time it is called
+    TEST_SUITE( suite, concurrency, resource... ) { ... }
+                    Puts the unit tests within the braces in a suite
+    TEST_SUITE_REOPEN( suite ) { ... }
+                    Adds more tests to a suite opened earlier in the file
+    SUITE_SETUP()   Defines a function called before the first test of
+                    the suite (within the braces of a TEST_SUITE)
+    SUITE_TEARDOWN()
+                    Defines a function called after the last test of the
+                    suite
+    TEST_FIXTURE_CACHED( type, function, version )
+                    Defines function() returning a read only array of type
+                    which may be loaded from an on disk cache
 
 It is expected that unit tests are in separate source files from regular code
 which are linked only if unit tests are to be run by the executable. Call
         selftest::runUnitTests() 
-to invoke all of the registered unit test functions.
+to invoke all of the registered unit test functions, or
+        selftest::runUnitTests( argc, argv )
+to also accept these command line options (others are ignored):
+    --jobs=n            Run up to n unit tests at once (0 for one per
+                        core, 1 is the default), see TEST_SUITE
+    --shuffle[=seed]    Run the unit tests in a random order, which is
+                        repeated by giving the seed printed
+    --update-golden     Rewrite golden files that do not match
+    --fixture-cache=dir Keep cached fixtures in dir (default is the
+                        environment variable SELFTEST_FIXTURE_CACHE, if set)
+    --benchmark[=pattern]
+                        After the unit tests, run the benchmarks with names
+                        containing pattern
+    --benchmark-time=s  Time each benchmark for s seconds (default 0.5)
+    --save-baseline=file
+                        Save the benchmark results in file
+    --baseline=file     Compare the benchmark results with those saved in
+                        file
+    --cold-cache        Also time each benchmark with nothing in the caches
+    --benchmark-noise=percent
+                        Time a benchmark again when its batches vary by
+                        more than this (default 10)
+    --pin-cpu[=n]       Run the benchmarks on CPU n only (default an
+                        isolated CPU or the last one)
+    --compare=first,second
+                        After the unit tests, time two benchmarks in turns
+                        and report the difference
+    --repeat=n          Run the unit tests n times, and write percentiles of
+                        the time each took
+    --verbose           Also note what passing checks measured, such as
+                        the speedup found by CHECK_EQUIVALENT and the calls
+                        per second of TEST_CONCURRENT
 
 A unit test source file consists of a sequence of routines mainly containing
 CHECKxxx()'s. Each routine is defined by the macro TEST_FUNCTION(function). For
@@ -136,6 +288,423 @@ Unit test routines will be executed in the order of appearance in the source.
 Both the name of the test function and the text of the CHECKIF will be visible
 if the test fails, so verbose names are useful.
 
+Tests that pass only when run in that order depend on each other, which
+will also make them fail when run concurrently. Run with --shuffle to find
+them. The seed of the shuffle is printed, and --shuffle=<seed> repeats the
+order. Tests wanting random numbers should use selftest::testRng(), a
+selftest::Rng seeded from the name of the test and the shuffle seed, so that
+they also repeat. PROPERTY_TEST cases are seeded the same way.
+
+Floating point results are rarely exactly equal to what is expected, so
+rather than CHECKIF( a==b ) use
+
+    CHECK_NEAR( sqrt( 2. ), 1.41421356, 1e-8, 0. );     // absolute error
+    CHECK_NEAR( big_sum( v ), 6.02e23, 0., 1e-12 );     // relative error
+    CHECK_ULP( std::sin( x ), reference_sin( x ), 1 );   // ulps of the float x
+
+NaNs are never near anything. The array forms check whole buffers, such as
+the output of a numeric kernel, in a branch free loop that compilers
+vectorize (at -O3), so a passing check runs at close to memory speed:
+
+    CHECK_ALL_ULP( out.data(), expected.data(), out.size(), 2 );
+
+If any elements fail, the message gives the number failing, the worst of
+them and its index, and a histogram of errors in powers of two of the
+tolerance (or of ulps).
+
+Unit tests can be grouped into suites. TEST_SUITE opens a namespace, and the
+tests within it share the suite's setup and teardown and its concurrency:
+
+    TEST_SUITE( database, selftest::Concurrency::serial, "db", "port 5432" )
+    {
+        SUITE_SETUP()       { start_test_database(); }
+        SUITE_TEARDOWN()    { stop_test_database(); }
+
+        TEST_FUNCTION( inserts ) { ... }
+        TEST_FUNCTION( queries ) { ... }
+    }
+
+With --jobs=n the tests are run by n worker threads, each taking the first
+test in order that may run beside those already running:
+    selftest::Concurrency::parallel
+                    The suite's tests may run at the same time as any others
+    selftest::Concurrency::serial
+                    One test of the suite at a time, in order (unless
+                    shuffled), though tests of other suites may run beside it
+    selftest::Concurrency::exclusive
+                    Nothing else runs while a test of the suite does
+Tests of suites naming the same resource never run at the same time. Tests
+not in any suite are in a serial suite of their own, so existing tests are
+safe with --jobs without change. Setup runs before, and teardown after, every
+test of the suite. If setup fails the suite's tests fail without being run.
+A suite may be reopened later in the same file with TEST_SUITE_REOPEN( suite ),
+or in another file by repeating its TEST_SUITE with the same arguments.
+
+Test fixtures are for input that is expensive to build and used by more than
+one test. The body runs the first time the fixture is used, even if that is
+from several threads at once, and every test after that shares the result:
+
+    TEST_FIXTURE( Schema, big_schema )
+    {
+        return parse_schema( read_file( "test/big.schema" ) );
+    }
+
+    TEST_FUNCTION( schema_has_types )
+    {
+        CHECKIF( big_schema().types.size() > 100 );
+    }
+
+Generated data sets can also be kept between runs. The body returns a
+std::vector of a plain data type and the fixture is a FixtureArray, which has
+data(), size(), begin(), end() and operator[]. If a cache directory is set,
+the array is saved there as <function>.fixture together with the version
+string, and later runs map the file into memory instead of running the body.
+Change the version whenever the body changes.
+
+    TEST_FIXTURE_CACHED( Point, million_points, "v2 seed 42" )
+    {
+        return generate_points( 1000000, 42 );
+    }
+
+Fixture names share one cache directory, so they should be unique within a
+program.
+
+CHECK_MATCHES_GOLDEN compares anything with data() and size(), such as a
+std::string or std::vector, byte for byte with a golden file. The file is
+mapped into memory rather than read, so checking even a very large output
+costs little more than a memcmp() of it. On failure the message gives the
+offset of the first difference with the bytes around it:
+
+    CHECK_MATCHES_GOLDEN( encode( frames ), "test/golden/frames.bin" );
+
+When the output is meant to change, run the tests with --update-golden and
+the files that differ are replaced (by renaming a complete new file over the
+old one) and noted rather than failed.
+
+CHECK_FOR_ALL is for exhaustive checks over large input domains. The range is
+split into contiguous chunks which are handed out to one worker thread per
+core. Every input is tested (the check does not stop at the first failure)
+and the message on failure gives the number of failing inputs and the first
+few of them in range order. The range may be anything with size() and
+operator[], such as a std::vector of inputs, or one of:
+
+    selftest::range( first, last )  The integers [first,last)
+    selftest::allValues<T>()        Every value of an integral type T of up to
+                                    32 bits (2^32 inputs for uint32_t)
+    selftest::allBitPatterns<F>()   Every float (or NaN, or infinity) having
+                                    the same size as a 32 bit integer
+
+    TEST_FUNCTION( fast_sqrt_is_exact )
+    {
+        CHECK_FOR_ALL( selftest::allBitPatterns<float>(), []( float f ) {
+            return !(f>=0.f) || fast_sqrt(f)==std::sqrt(f); } );
+        CHECK_FOR_ALL( selftest::allValues<uint32_t>(), []( uint32_t ab ) {
+            return saturating_add( ab>>16, ab&0xffff )==ref_add( ab>>16, ab&0xffff ); } );
+    }
+
+Predicates must be safe to call from several threads at once. An exception
+thrown by a predicate (including a failed CHECKIF within it) fails the test.
+
+CHECK_EQUIVALENT is for differential testing of an optimized function against
+a simple reference version. The generator is called as generator(i) for
+i in [0,n) and must return the same input for the same i. Inputs are
+generated in batches, each batch is passed through both functions (each
+timed separately, alternating which goes first) and the outputs compared
+with compare( fast(x), reference(x) ), which defaults to ==. Batches run in
+parallel as for CHECK_FOR_ALL. On success, with --verbose, the measured
+speedup is written to std::clog as a note. On failure the first few
+mismatching inputs and both outputs are given.
+
+    TEST_FUNCTION( popcount_matches_loop )
+    {
+        CHECK_EQUIVALENT( popcount_swar, popcount_loop,
+                          []( uint64_t i ) { return uint32_t( i*2654435761u ); },
+                          10000000 );
+        // std::exp is overloaded, so the one wanted is named with a cast
+        CHECK_EQUIVALENT_CMP( fast_exp, static_cast<double(*)(double)>( std::exp ),
+                              uniform_doubles, 1000000, []( double a, double b ) {
+                                    return std::fabs( a-b ) <= 1e-12*b; } );
+    }
+
+PROPERTY_TEST checks that a property holds for many generated inputs rather
+than a few hand picked ones. Each generator supplies one parameter, and the
+parameters must be declared with the generators' value types, by value:
+
+    PROPERTY_TEST( fizzbuzz_of_multiples_of_three,
+                   selftest::integers( 1, 333 ), selftest::booleans() )
+        ( int third, bool extra )
+    {
+        CHECKIF( fizzbuzz( 3*third ).substr( 0,4 ) == "Fizz" );
+    }
+
+The generators are:
+
+    selftest::integers<T>( lo, hi )     Integers in [lo,hi], whole type by
+                                        default, with extra edge cases
+    selftest::reals( lo, hi )           Floating point values in [lo,hi]
+    selftest::booleans()                true or false
+    selftest::just( v )                 Always v
+    selftest::vectorsOf( gen, max )     std::vectors of up to max values
+    selftest::tuples( gen... )          std::tuples of values
+    selftest::map( gen, f )             f( x ) for generated x
+    selftest::filter( gen, pred )       Generated x for which pred( x )
+
+Arguments for case i are generated from a seed derived from the test name
+and i, so runs are repeatable and the cases are checked in parallel. When a
+case fails its arguments are shrunk (integers and reals towards zero, vectors
+by dropping and shrinking elements) for as long as the property still fails.
+The check failure for the smallest counterexample is reported, followed by a
+note with the counterexample, the original and the seed. Generators of
+numbers and booleans never allocate memory.
+
+A generator is any class with a value_type, an operator()( selftest::Rng& )
+returning a new value, and shrink( v, k, out ) which sets out to the k'th
+simpler alternative to v and returns false when there are no more.
+
+TEST_FUZZ defines a function taking a const std::uint8_t* and a std::size_t
+with the given parameter names. The same CHECKxxx() and ASSERT()s used in unit
+tests check the result:
+
+    TEST_FUZZ( parse_header, data, size )
+    {
+        Header h;
+        if (parse( data, size, h ))
+            CHECKIF( h.length <= size );
+    }
+
+In ordinary builds each fuzz target also registers the unit test
+parse_header_corpus, which calls it with every file in the directory
+$SELFTEST_CORPUS/parse_header (SELFTEST_CORPUS defaults to "corpus"), in
+parallel. Save crashing inputs and the fuzzer's corpus there and they are
+replayed on every test run. If the directory has no files the test passes,
+with a line on std::clog saying where it looked.
+
+To build a fuzzer, compile the file with SELFTEST_IMPLEMENTATION (without a
+main program) with
+        #define SELFTEST_FUZZ
+and link with -fsanitize=fuzzer. This defines LLVMFuzzerTestOneInput(), which
+turns failed checks and escaping exceptions into a crash. If the program has
+more than one fuzz target choose one with the environment variable
+SELFTEST_FUZZ_TARGET. See "make fuzz".
+
+Concurrent code, such as a lock free queue, is tested by calling it from
+several threads at once:
+
+    TEST_CONCURRENT( queue_keeps_order, 4, 100000 )( unsigned thread,
+                                                     std::size_t i )
+    {
+        shared_queue.push( thread, i );
+        CHECKIF( shared_queue.size() <= 4*100000 );
+    }
+
+The threads start together from a barrier, so that they contend. Each is
+given its index and the iteration, and each has its own testRng(). The first
+check that fails on any thread stops them all and fails the test, and when
+they pass, with --verbose, the calls per second of each thread are written
+to std::clog.
+With 0 threads there is one per core.
+
+Checks may also be made on threads a test starts itself, if they are
+started as a selftest::TestThread, which is used like std::thread:
+
+    TEST_FUNCTION( cache_is_thread_safe )
+    {
+        std::vector<selftest::TestThread> readers;
+        for (int i = 0; i < 4; ++i)
+            readers.emplace_back( [&] { CHECKIF( cache.get( key ) == value ); } );
+    }
+
+A failed check ends its thread and the test fails when it returns. Threads
+the test does not start, such as those of a thread pool, join the test with
+    selftest::TestContext* test = selftest::TestContext::current();
+    ...
+    selftest::TestContext::Scope scope( test );     // on the pool thread
+after which failed checks on that thread are recorded, without throwing,
+and fail the test. Every thread must be finished with the test before it
+returns. TestThreads are joined when destroyed.
+
+When compiled as C++20 (or later), unit tests can be coroutines that wait
+on virtual time and on futures:
+
+    TEST_ASYNC( reconnects_after_timeout )
+    {
+        Client client( server_address );
+        std::future<Request> received = server.nextRequest();
+        co_await selftest::sleepFor( std::chrono::seconds( 30 ) );
+        CHECKIF( co_await client.send( ping ) == pong );  // a selftest::Task
+        CHECKIF( co_await selftest::awaitFuture( received ) == ping );
+    }
+
+After the other unit tests have finished, every TEST_ASYNC is started at once
+on an event loop run by --jobs threads. When none of them can run, the loop
+checks the futures awaited, and otherwise advances selftest::clock to the
+first timer, so thousands of tests waiting on timers finish in the time it
+takes to run them. Async functions they call return selftest::Task<T>, which
+starts when co_awaited. Async tests are not part of any TEST_SUITE and have
+no time limit. All source files with unit tests and the one with
+SELFTEST_IMPLEMENTATION must be compiled for the same C++ standard. See
+"make test20".
+
+Averages hide the slow calls that matter, so CHECK_LATENCY checks
+percentiles of the time each evaluation takes:
+
+    CHECK_LATENCY( cache.get( key ), 100000,
+                   p99 <= std::chrono::microseconds( 5 ),
+                   p999 <= std::chrono::microseconds( 50 ) );
+
+The bounds may be on p50, p90, p99, p999, p9999 and p100 (the slowest), and
+in C++14 durations may be written as 5us. The times, less the time it takes
+to read the clock, are kept in a selftest::Histogram, and if a bound is
+exceeded the message has the percentiles of them all.
+
+Benchmarks time code more carefully, over many calls, and are run only when
+asked for with --benchmark:
+
+    BENCHMARK( parse_small_message )( selftest::Benchmark& b )
+    {
+        std::string message = make_message( 100 );     // Not timed
+        b.run( [&] { return parse( message ); } );
+    }
+
+run() calls the function in batches that take long enough for the clock to
+time accurately (the time stamp counter where it runs at a constant rate,
+which takes a few nanoseconds to read, and otherwise steady_clock), for
+--benchmark-time seconds, and records the time per call of each batch.
+What the function returns is kept from being optimized away, as is anything
+given to selftest::doNotOptimize(). One line per benchmark is written to
+std::cout, with the median time per call and the percentiles of the batches.
+Benchmarks run one at a time on the main thread, after the unit tests, and a
+benchmark that throws or fails a check fails. See "make benchmark".
+
+Interchangeable implementations are compared on the same workloads by a
+benchmark for each type, where the benchmark function may ask to be called
+once for each of several workload sizes. After the benchmarks, a table for
+each TEMPLATE_BENCHMARK gives the time for each type and size, and the
+fastest:
+
+    TEMPLATE_BENCHMARK( insert, std::map<int,int>, std::unordered_map<int,int> )
+        ( selftest::Benchmark& b )
+    {
+        std::size_t n = b.workloadSize( { 16, 1024, 65536 } );
+        b.run( [&] {
+            BenchType m;
+            for (std::size_t i = 0; i < n; ++i)
+                m[int( i )] = 0;
+            return m.size(); } );
+    }
+
+Likewise TEMPLATE_TEST( name, types... ) is a unit test for each type, which
+is TestType in the body. Both are named name<type>.
+
+When each call needs fresh input, such as an unsorted array to sort, run()
+takes a function to make it. The inputs for a whole batch are made before
+the batch is timed, so the clock is still read only twice a batch. Making
+them counts toward the benchmark's time, and batches are kept small enough
+for a slow setup to fit several in it:
+
+    BENCHMARK( sort_1000 )( selftest::Benchmark& b )
+    {
+        b.run( [] { return random_vector( 1000 ); },
+               []( std::vector<int>& v ) { std::sort( v.begin(), v.end() ); } );
+    }
+
+Otherwise b.pauseTiming() and b.resumeTiming() leave out part of a call, at
+the cost of reading the clock twice more each time.
+
+Times are kept in a selftest::Histogram, which has buckets no wider than
+1/128 of the values in them, so that it takes a fixed 58kB whatever is
+recorded, percentiles are within 0.4% and histograms can be added together.
+A selftest::SharedHistogram may be recorded in by any number of threads at
+once without locks, and snapshot() gives their total. A histogram is saved
+with toBase64(), which is how the samples of each benchmark are saved by
+--save-baseline, and fromBase64() reads it back.
+
+When the time per call is not the whole story, a benchmark says how much
+each call processes and keeps its own counts, which are written as rates
+under the times and saved and compared with the baseline too:
+
+    BENCHMARK( parse_messages )( selftest::Benchmark& b )
+    {
+        std::string message = make_message( 100 );
+        b.setBytesProcessed( message.size() );     // Gives GB/s
+        b.setItemsProcessed( 1 );                   // Gives messages/s
+        double& cached = b.counter( "cache_hits" ); // Per call and per second
+        b.run( [&] { return parse( message, &cached ); } );
+    }
+
+Two implementations are best compared with --compare=first,second, which
+runs the two benchmarks on a thread each and has them take turns, in a
+random order each round, timing 1ms of calls. A slow spell of the machine
+then affects both alike, and the mean of their difference in each round is
+reported with its 95% confidence interval, which is narrow enough to see
+changes of 1-2%. Both threads are kept on one CPU, the one the comparison
+started on unless --pin-cpu says otherwise, so that neither has a faster
+core or a warmer cache. To compare two builds of the same code, build both
+into the test program under different names; loading them from shared
+libraries is not supported.
+
+With --cold-cache, or after coldCache( true ), run() also times single
+calls with the caches cold, as code often runs after a request switch, and
+a second line gives those times. Between calls the inputs declared with
+coldInput() are flushed from the caches, or if none were, a buffer half as
+large again as the last level cache is written. Neither is timed, though
+both count toward the benchmark's time, and instructions may stay cached.
+
+Before the first benchmark, the CPU, frequency governor, turbo and
+hyperthreading settings, kernel, compiler and load are written out, with a
+warning if the machine is busy. --save-baseline keeps a fingerprint of these
+(but not the load), and starts the file afresh rather than keeping entries
+from a different machine or build, and --baseline does not compare with
+results from one. When the spread of the middle 80% of batches is
+more than --benchmark-noise percent of the median, the benchmark is timed up
+to twice more and the quietest run kept; if that is still noisy, the line
+says so. --pin-cpu keeps the benchmarks on one CPU, an isolated one (see the
+isolcpus kernel option) if there is one.
+
+Each unit test is allowed 2 seconds to complete. Virtual time the test's
+thread spends sleeping on selftest::clock (see below) counts toward that
+limit.
+
+
+Using selftest::clock
+---------------------
+
+selftest::clock meets the requirements of a steady clock (it can be used
+wherever std::chrono::steady_clock can) but its time only moves when it is
+told to. Code under test takes the clock as a template parameter or typedef
+and unit tests substitute selftest::clock, so sleeps and timeouts complete
+immediately:
+
+    template <class Clock> bool retry( std::function<bool()> op );
+
+    TEST_FUNCTION( retry_gives_up_after_ten_seconds )
+    {
+        auto start = selftest::clock::now();
+        CHECKIF( !retry<selftest::clock>( []{ return false; } ) );
+        CHECKIF( selftest::clock::now()-start >= std::chrono::seconds(10) );
+    }
+
+    selftest::clock::now()
+                    Current virtual time
+    selftest::clock::advance( duration )
+                    Moves virtual time forward
+    selftest::clock::autoAdvance( duration )
+                    Every call to now() moves virtual time forward by the
+                    given step (zero, the default, turns this off)
+    selftest::clock::advancedByThisThread()
+                    Total virtual time moved forward by advance() and sleeps
+                    on the calling thread
+    selftest::clock::sleep_for( duration )
+    selftest::clock::sleep_until( time_point )
+                    Advance virtual time instead of blocking
+    selftest::clock::wait_for( cv, lock, duration, predicate )
+    selftest::clock::wait_until( cv, lock, time_point, predicate )
+                    Timed condition variable waits. If the predicate is false
+                    virtual time is advanced to the deadline and the predicate
+                    re-evaluated.
+
+Virtual time is shared by all threads and never goes backwards.
+
 
 An example follows
 
@@ -169,6 +738,71 @@ TEST_FUNCTION( error_handler_testing )
 #include <iostream>
 #include <chrono>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <exception>
+#include <type_traits>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <tuple>
+#include <utility>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <map>
+#include <set>
+#include <random>
+#include <new>
+#include <cstddef>
+
+#include <iomanip>
+#include <cctype>
+#include <typeinfo>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SELFTEST_HAS_TSC 1
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <optional>
+#include <future>
+#include <deque>
+#endif
+
+#if defined(SELFTEST_IMPLEMENTATION) && defined(__GNUC__)
+    #include <cxxabi.h>
+#endif
+
+#if defined(SELFTEST_IMPLEMENTATION) && (defined(__GLIBC__) || defined(__APPLE__))
+    #include <execinfo.h>
+    #include <dlfcn.h>
+#endif
+
+#if defined(SELFTEST_IMPLEMENTATION) && (defined(__unix__) || defined(__APPLE__))
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/utsname.h>
+#endif
+
+#if defined(__linux__)
+    #include <sched.h>
+#endif
 
 // Tracing support classes and typedefs
 #ifdef TRACING
@@ -250,8 +884,24 @@ TEST_FUNCTION( error_handler_testing )
 
 // Unit testing Macros
 #define TEST_FUNCTION( X ) selftest::TestFunc X; \
-                           selftest::UnitTest unittester ## X ( X,#X ); \
+                           selftest::UnitTest unittester ## X ( X,#X, \
+                                selftest_suite::current() ); \
                            void X()
+#define TEST_SUITE( X, ... ) \
+    namespace X { namespace selftest_suite { \
+        inline selftest::Suite& current() { \
+            static selftest::Suite suite( #X, __VA_ARGS__ ); \
+            return suite; } } } \
+    namespace X
+#define TEST_SUITE_REOPEN( X ) namespace X
+#define SUITE_SETUP() selftest::TestFunc selftest_setup; \
+    selftest::SuiteHook selftest_setuphook( selftest_suite::current(), \
+                                            selftest_setup, true ); \
+    void selftest_setup()
+#define SUITE_TEARDOWN() selftest::TestFunc selftest_teardown; \
+    selftest::SuiteHook selftest_teardownhook( selftest_suite::current(), \
+                                               selftest_teardown, false ); \
+    void selftest_teardown()
 #define UNITTEST_FAIL( X ) \
         selftest::thrower( selftest::failType::badunittest, \
                               X, __func__, __FILE__, __LINE__ )
@@ -265,6 +915,97 @@ TEST_FUNCTION( error_handler_testing )
     catch(const E &e) {caught_expected=true;} \
     if(!caught_expected) UNITTEST_FAIL( #X " should throw " #E ); \
     }
+#define CHECK_FOR_ALL( R,P ) { auto forall_result = \
+    selftest::checkForAll( (R),(P) ); \
+    if(forall_result.numFailed) UNITTEST_FAIL( (#P " for all " #R \
+        + forall_result.describe()).c_str() ); }
+#define PROPERTY_TEST( X, ... ) \
+    PROPERTY_TEST_N( X, selftest::propertyCases, __VA_ARGS__ )
+#define PROPERTY_TEST_N( X, N, ... ) \
+    auto X ## _generators = std::make_tuple( __VA_ARGS__ ); \
+    selftest::PropertyFunction<decltype( X ## _generators )>::type \
+        X ## _property; \
+    TEST_FUNCTION( X ) { selftest::checkProperty( #X, X ## _generators, \
+        X ## _property, (N), __FILE__, __LINE__ ); } \
+    void X ## _property
+#define CHECK_NEAR( A,B,ABS,REL ) { double near_a=(A); double near_b=(B); \
+    if(!selftest::near( near_a,near_b,double(ABS),double(REL) )) \
+    UNITTEST_FAIL( ("\n" #A " should be near\n" #B " but" + \
+        selftest::describeNear( near_a,near_b,(ABS),(REL) )).c_str() );}
+#define CHECK_ULP( A,B,U ) { auto ulp_a=(A); decltype(ulp_a) ulp_b=(B); \
+    auto ulps=selftest::ulpDistance( ulp_a,ulp_b ); if(ulps>std::uint64_t(U)) \
+    UNITTEST_FAIL( ("\n" #A " should be within " #U " ulps of\n" #B " but" + \
+        selftest::describeUlp( ulp_a,ulp_b,ulps,(U) )).c_str() );}
+#define CHECK_ALL_NEAR( A,B,N,ABS,REL ) { auto near_result = \
+    selftest::checkAllNear( (A),(B),(N),(ABS),(REL) ); \
+    if(near_result.numFailed) UNITTEST_FAIL( (#A " near " #B \
+        + near_result.describe( "error" )).c_str() ); }
+#define CHECK_ALL_ULP( A,B,N,U ) { auto ulp_result = \
+    selftest::checkAllUlp( (A),(B),(N),(U) ); \
+    if(ulp_result.numFailed) UNITTEST_FAIL( (#A " within " #U " ulps of " #B \
+        + ulp_result.describe( "ulps" )).c_str() ); }
+#define CHECK_MATCHES_GOLDEN( B,P ) { auto golden_result = \
+    selftest::checkGolden( (B),(P) ); \
+    if(!golden_result.matches) UNITTEST_FAIL( (#B \
+        + golden_result.describe()).c_str() ); \
+    if(golden_result.updated) selftest::note( (std::string( "updated " ) \
+        + (P)).c_str(), __FILE__, __LINE__ ); }
+#define TEST_FIXTURE( T, X ) \
+    T X ## _build(); \
+    const T& X() { static const T fixture = X ## _build(); return fixture; } \
+    T X ## _build()
+#define TEST_FIXTURE_CACHED( T, X, V ) \
+    std::vector<T> X ## _build(); \
+    const selftest::FixtureArray<T>& X() { \
+        static const selftest::FixtureArray<T> fixture = \
+            selftest::cachedFixture<T>( #X, (V), X ## _build ); \
+        return fixture; } \
+    std::vector<T> X ## _build()
+#define TEST_FUZZ( X, D, S ) \
+    void X( const std::uint8_t* D, std::size_t S ); \
+    selftest::FuzzTarget fuzztarget ## X ( X,#X ); \
+    TEST_FUNCTION( X ## _corpus ) { selftest::replayCorpus( X,#X ); } \
+    void X( const std::uint8_t* D, std::size_t S )
+#define TEST_CONCURRENT( X, T, N ) \
+    void X ## _thread( unsigned, std::size_t ); \
+    TEST_FUNCTION( X ) { selftest::runConcurrent( X ## _thread, #X, (T), (N), \
+        __FILE__, __LINE__ ); } \
+    void X ## _thread
+#if defined(__cpp_impl_coroutine)
+#define TEST_ASYNC( X ) selftest::Task<> X(); \
+    selftest::AsyncTest asynctest ## X ( X,#X ); \
+    selftest::Task<> X()
+#endif
+#define CHECK_LATENCY( E,N,... ) { using namespace selftest::latency; \
+    auto latency_result = selftest::checkLatency( [&]{ return E; }, (N), \
+        { __VA_ARGS__ } ); \
+    if(!latency_result.exceeded.empty()) UNITTEST_FAIL( \
+        (#E " latency" + latency_result.describe()).c_str() ); }
+#define BENCHMARK( X ) void X( selftest::Benchmark& ); \
+    selftest::BenchmarkTarget benchmarktarget ## X ( X,#X ); \
+    void X
+#define TEMPLATE_TEST( X, ... ) template <class TestType> void X(); \
+    struct X ## _instances { template <class T> \
+        static selftest::TestFunc* get() { return X<T>; } }; \
+    selftest::TemplateTest<X ## _instances, __VA_ARGS__> templatetest ## X ( \
+        #X, selftest_suite::current() ); \
+    template <class TestType> void X()
+#define TEMPLATE_BENCHMARK( X, ... ) \
+    template <class BenchType> void X( selftest::Benchmark& ); \
+    struct X ## _instances { template <class T> \
+        static selftest::BenchmarkFunc* get() { return X<T>; } }; \
+    selftest::TemplateBenchmark<X ## _instances, __VA_ARGS__> \
+        templatebenchmark ## X ( #X ); \
+    template <class BenchType> void X
+#define CHECK_EQUIVALENT( F,R,G,N ) \
+    CHECK_EQUIVALENT_CMP( F,R,G,N,selftest::EqualTo() )
+#define CHECK_EQUIVALENT_CMP( F,R,G,N,C ) { auto equivalent_result = \
+    selftest::checkEquivalent( (F),(R),(G),(N),(C) ); \
+    if(equivalent_result.numFailed) UNITTEST_FAIL( (#F " equivalent to " #R \
+        + equivalent_result.describe()).c_str() ); \
+    if(selftest::options().verbose) selftest::note( (#F " is " \
+        + equivalent_result.describeSpeedup() + " " #R).c_str(), \
+        __FILE__, __LINE__ ); }
 
 
 // Declaration of support classes, types, and routines
@@ -298,200 +1039,5378 @@ enum class failType {
 
 typedef void TestFunc();
 
-struct FailRatio {
-    int numFailedTests;
-    int numTests;
-};
-
 
-class UnitTest {
+// A steady clock that runs in virtual time
+class clock {
 public:
-    UnitTest( TestFunc *tf, const char* tfName );
-    static FailRatio runUnitTestsImpl();
-
-private:
-    bool callUnitTest();
-
-    TestFunc *testfunc_;
-    UnitTest *next_;
-    const char *tfname_;
-};
-
-
-void thrower(
-    const failType ft,
-    const char* failedPredicate,
-    const char* function,
-    const char* fileName,
-    int lineNum );
+    typedef std::chrono::nanoseconds duration;
+    typedef duration::rep rep;
+    typedef duration::period period;
+    typedef std::chrono::time_point<clock> time_point;
+    static const bool is_steady = true;
 
-FailRatio runUnitTests();
+    static time_point now() noexcept;
+    static time_point peek() noexcept;     // now() without auto advance
+    static duration advancedByThisThread() noexcept;
+    static void advance( duration d ) noexcept;
+    static void autoAdvance( duration step ) noexcept;
 
+    template <class Rep, class Period>
+    static void sleep_for( const std::chrono::duration<Rep,Period>& d )
+    {
+        advance( std::chrono::duration_cast<duration>( d ) );
+    }
 
-#ifdef SELFTEST_IMPLEMENTATION
+    static void sleep_until( time_point tp ) noexcept;
 
-void thrower(
-    const failType ft,
-    const char* failedPredicate,
-    const char* function,
-    const char* fileName,
-    int lineNum )
-{    
-    /* Compose message texts:
-    <file>:<line>:0: error: <ft text> '<failedPredicate>' failed in <function>.
-    */
-    std::string message;
-    if (fileName && lineNum) {
-        message = std::string(fileName) + ":" + 
-                std::to_string(lineNum) + ":0: error: ";
-    }
-    switch (ft) {
-    case failType::badarg:
-        message += "Argument test";
-        break;
-    case failType::badassert:
-        message += "Assertion";
-        break;
-    case failType::badselftest:
-        message += "Self test";
-        break;
-    case failType::badunittest:
-        message += "Unit test";
-        break;
-    case failType::overlimit:
-        message += "Reasonable limit";
-        break;
+    template <class Predicate>
+    static bool wait_until( std::condition_variable&,
+                            std::unique_lock<std::mutex>&,
+                            time_point tp,
+                            Predicate pred )
+    {
+        // The caller holds the lock, so the predicate can not change under
+        // us unless pred itself changes it. Time out at once in virtual time.
+        if (pred())
+            return true;
+        sleep_until( tp );
+        return pred();
     }
 
-    if (failedPredicate)
-        message += std::string(" '") + failedPredicate + "'";
-    message += " failed";
-    if (function)
-        message += std::string(" in ") + function;
-    message += '.';
-
-    switch (ft) {
-    case failType::badarg:
-        throw std::invalid_argument(message);
-        break;
-    case failType::badassert:
-        throw selftest::selftest_error(message);
-        break;
-    case failType::badselftest:
-        throw selftest::selftest_error(message);
-        break;
-    case failType::badunittest:
-        std::cerr << message << std::endl;
-        throw terminate_unittest();
-        break;
-    case failType::overlimit:
-        throw selftest::over_reasonable_limit(message);
-        break;
+    template <class Rep, class Period, class Predicate>
+    static bool wait_for( std::condition_variable& cv,
+                          std::unique_lock<std::mutex>& lock,
+                          const std::chrono::duration<Rep,Period>& d,
+                          Predicate pred )
+    {
+        return wait_until( cv, lock,
+                    peek() + std::chrono::duration_cast<duration>( d ),
+                    pred );
     }
 
-    return;
-}
+private:
+    static std::atomic<rep> now_;
+    static std::atomic<rep> step_;
+    static thread_local rep advanced_;
+};
 
 
-UnitTest::UnitTest( TestFunc *tf, const char* tfName )
-    : testfunc_( tf ),
-      tfname_( tfName )
+// Writes a value for a failure message, if it can be written at all
+template <class T>
+auto printValueImpl( std::ostream& os, const T& v, int )
+    -> decltype( os << v, void() )
 {
-    static UnitTest *head = nullptr;
-    next_ = head;
-    if (tf)
-        head = this;
-    else
-        head = nullptr;			// Last test registered, reset list
+    os << v;
 }
 
-bool UnitTest::callUnitTest()
+template <class T>
+void printValueImpl( std::ostream& os, const T&, long )
 {
-    // Maximum duration for a single unit test
-    const int time_limit_seconds = 2;
-    bool failedTest = false;
+    os << "<unprintable>";
+}
 
-    try {
-        auto testStart = std::chrono::high_resolution_clock::now();
+template <class T>
+void printValue( std::ostream& os, const T& v )
+{
+    printValueImpl( os, v, 0 );
+}
 
-        testfunc_();
+// int8_t and uint8_t as numbers, not characters
+inline void printValue( std::ostream& os, signed char v ) { os << int( v ); }
+inline void printValue( std::ostream& os, unsigned char v ) { os << int( v ); }
 
-        auto duration = std::chrono::high_resolution_clock::now()-testStart;
-        if ( duration > std::chrono::seconds(time_limit_seconds) ) {
-            std::cerr << "Unit test " << tfname_ << " not complete within "
-                 << time_limit_seconds << " seconds." << std::endl;
-            failedTest = true;
-        }
-        return failedTest;
+template <class T>
+void printValue( std::ostream& os, const std::vector<T>& v )
+{
+    os << "{";
+    for (std::size_t i = 0; i < v.size(); ++i) {
+        os << (i ? ", " : "");
+        printValue( os, v[i] );
     }
+    os << "}";
+}
 
-    catch( const terminate_unittest& e ) {
-        // Message, already written
-        failedTest = true;
-        return failedTest;
-    }
+// Writes <fileName>:<lineNum>:0: note: <message> to std::clog
+void note( const char* message, const char* fileName, int lineNum );
 
-    catch( const char* e ) {
-        std::cerr << "Exception thrown during unit test '" << tfname_
-             <<  "': \"" << e << "\"." << std::endl;
-    }
 
-    catch( const std::exception& e ) {
-        std::cerr << "Exception thrown during unit test '" << tfname_
-             << "': " << e.what() << "." << std::endl;
-    }
+// Number of worker threads used for parallel checks
+unsigned workerCount();
 
-    catch( ... ) {
-        std::cerr << "Exception of unknown type thrown during unit test '"
-             << tfname_ << "'." << std::endl;
-    }
+// Calls body( begin, end, worker ) for consecutive chunks of [0,count) on
+// workerCount() threads. The first exception thrown by body is rethrown
+// here once all workers have stopped.
+template <class Body>
+void parallelFor( std::uint64_t count, std::uint64_t chunk, Body body )
+{
+    std::uint64_t numChunks = (count + chunk - 1) / chunk;
+    std::uint64_t numWorkers = std::min<std::uint64_t>( workerCount(),
+                                                        numChunks );
+    std::atomic<std::uint64_t> next( 0 );
+    std::exception_ptr error;
+    std::mutex errorLock;
 
-    failedTest = true;
-    return failedTest;
-}
+    auto work = [&]( unsigned worker ) {
+        try {
+            std::uint64_t c;
+            while ((c = next++) < numChunks) {
+                body( c*chunk, std::min( count, (c+1)*chunk ), worker );
+            }
+        }
+        catch( ... ) {
+            std::lock_guard<std::mutex> guard( errorLock );
+            if (!error)
+                error = std::current_exception();
+            next = numChunks;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned w = 1; w < numWorkers; ++w)
+        threads.emplace_back( work, w );
+    work( 0 );
+    for (auto& t : threads)
+        t.join();
+
+    if (error)
+        std::rethrow_exception( error );
+}
+
+
+// The integers [first,last)
+template <class T>
+class IndexRange {
+public:
+    IndexRange( T first, std::uint64_t size ) : first_( first ), size_( size ) {}
+    std::uint64_t size() const { return size_; }
+    T operator[]( std::uint64_t i ) const { return T( first_ + i ); }
+private:
+    T first_;
+    std::uint64_t size_;
+};
+
+template <class T>
+IndexRange<T> range( T first, T last )
+{
+    static_assert( std::is_integral<T>::value, "range() needs integers" );
+    return IndexRange<T>( first, last > first ? std::uint64_t(last - first) : 0 );
+}
+
+template <class T>
+IndexRange<T> allValues()
+{
+    static_assert( std::is_integral<T>::value && sizeof(T) <= 4,
+                   "allValues() needs an integer of 32 bits or less" );
+    return IndexRange<T>( std::numeric_limits<T>::min(),
+                          std::uint64_t(1) << (8*sizeof(T)) );
+}
+
+// Every bit pattern of F, interpreted as an F
+template <class F>
+class BitPatternRange {
+public:
+    typedef std::uint32_t bits_type;
+    static_assert( sizeof(F) == sizeof(bits_type),
+                   "allBitPatterns() needs a 32 bit type" );
+    std::uint64_t size() const { return std::uint64_t(1) << 32; }
+    F operator[]( std::uint64_t i ) const
+    {
+        bits_type bits = bits_type( i );
+        F f;
+        std::memcpy( &f, &bits, sizeof f );
+        return f;
+    }
+};
+
+template <class F>
+BitPatternRange<F> allBitPatterns()
+{
+    return BitPatternRange<F>();
+}
+
+
+// Result of checkForAll()
+template <class T>
+struct ForAllResult {
+    std::uint64_t numFailed;
+    std::uint64_t numChecked;
+    std::vector<T> firstFailures;           // In range order
+
+    std::string describe() const
+    {
+        std::ostringstream os;
+        os << ": " << numFailed << " of " << numChecked << " inputs failed,"
+           << " first failing:";
+        for (auto& f : firstFailures) {
+            os << " ";
+            printValue( os, f );
+        }
+        return os.str();
+    }
+};
+
+const std::uint64_t forAllChunk = 1 << 14;  // Inputs per work item
+const std::size_t forAllReported = 8;       // Failing inputs reported
+
+template <class Range, class Predicate>
+auto checkForAll( const Range& r, Predicate pred )
+    -> ForAllResult<typename std::decay<decltype( r[0] )>::type>
+{
+    typedef typename std::decay<decltype( r[0] )>::type value_type;
+    struct WorkerState {
+        std::uint64_t numFailed = 0;
+        std::vector<std::uint64_t> failures;
+    };
+    std::vector<WorkerState> state( workerCount() );
+
+    parallelFor( r.size(), forAllChunk,
+            [&]( std::uint64_t begin, std::uint64_t end, unsigned worker ) {
+        WorkerState& ws = state[worker];
+        for (std::uint64_t i = begin; i < end; ++i) {
+            if (!pred( r[i] )) {
+                // Chunks are taken in order so each worker's failures are
+                // ascending and its first few are all that might be reported
+                if (ws.failures.size() < forAllReported)
+                    ws.failures.push_back( i );
+                ++ws.numFailed;
+            }
+        }
+    } );
+
+    ForAllResult<value_type> result;
+    result.numFailed = 0;
+    result.numChecked = r.size();
+    std::vector<std::uint64_t> failures;
+    for (auto& ws : state) {
+        result.numFailed += ws.numFailed;
+        failures.insert( failures.end(), ws.failures.begin(), ws.failures.end() );
+    }
+    std::sort( failures.begin(), failures.end() );
+    if (failures.size() > forAllReported)
+        failures.resize( forAllReported );
+    for (auto i : failures)
+        result.firstFailures.push_back( r[i] );
+    return result;
+}
+
+
+// Default comparison for checkEquivalent()
+struct EqualTo {
+    template <class L, class R>
+    bool operator()( const L& l, const R& r ) const { return l == r; }
+};
+
+// Result of checkEquivalent()
+template <class Input, class Output>
+struct EquivalenceResult {
+    struct Mismatch {
+        std::uint64_t index;
+        Input input;
+        Output fast;
+        Output reference;
+    };
+
+    std::uint64_t numFailed;
+    std::uint64_t numChecked;
+    std::vector<Mismatch> firstMismatches;  // In generator order
+    std::chrono::nanoseconds fastTime;
+    std::chrono::nanoseconds referenceTime;
+
+    double speedup() const
+    {
+        return fastTime.count() ?
+            double( referenceTime.count() ) / fastTime.count() : 0.;
+    }
+
+    std::string describeSpeedup() const
+    {
+        std::ostringstream os;
+        os.precision( 3 );
+        os << speedup() << "x as fast as";
+        return os.str();
+    }
+
+    std::string describe() const
+    {
+        std::ostringstream os;
+        os << ": " << numFailed << " of " << numChecked << " inputs differ";
+        for (auto& m : firstMismatches) {
+            os << "\n    input " << m.index << " (";
+            printValue( os, m.input );
+            os << ") gives ";
+            printValue( os, m.fast );
+            os << " not ";
+            printValue( os, m.reference );
+        }
+        return os.str();
+    }
+};
+
+const std::uint64_t equivalentBatch = 1024; // Inputs generated at once
+
+template <class Fast, class Reference, class Generator, class Compare>
+auto checkEquivalent( Fast fast, Reference reference, Generator gen,
+                      std::uint64_t n, Compare compare )
+    -> EquivalenceResult<
+            typename std::decay<decltype( gen( std::uint64_t() ) )>::type,
+            typename std::decay<decltype( reference( gen( std::uint64_t() ) ) )>::type >
+{
+    typedef typename std::decay<decltype( gen( std::uint64_t() ) )>::type
+            input_type;
+    typedef typename std::decay<decltype( reference( gen( std::uint64_t() ) ) )>::type
+            output_type;
+    typedef EquivalenceResult<input_type,output_type> result_type;
+    typedef std::chrono::high_resolution_clock timer;
+
+    struct WorkerState {
+        std::vector<input_type> inputs;
+        std::vector<output_type> fastOut;
+        std::vector<output_type> referenceOut;
+        std::uint64_t numFailed = 0;
+        std::vector<typename result_type::Mismatch> mismatches;
+        timer::duration fastTime = timer::duration::zero();
+        timer::duration referenceTime = timer::duration::zero();
+    };
+    std::vector<WorkerState> state( workerCount() );
+
+    parallelFor( n, equivalentBatch,
+            [&]( std::uint64_t begin, std::uint64_t end, unsigned worker ) {
+        WorkerState& ws = state[worker];
+        ws.inputs.clear();
+        for (std::uint64_t i = begin; i < end; ++i)
+            ws.inputs.push_back( gen( i ) );
+
+        auto runFast = [&] {
+            ws.fastOut.clear();
+            auto start = timer::now();
+            for (auto& x : ws.inputs)
+                ws.fastOut.push_back( fast( x ) );
+            ws.fastTime += timer::now() - start;
+        };
+        auto runReference = [&] {
+            ws.referenceOut.clear();
+            auto start = timer::now();
+            for (auto& x : ws.inputs)
+                ws.referenceOut.push_back( reference( x ) );
+            ws.referenceTime += timer::now() - start;
+        };
+        // Whichever goes second finds the inputs in cache, so take turns
+        if ((begin / equivalentBatch) % 2) {
+            runReference();
+            runFast();
+        } else {
+            runFast();
+            runReference();
+        }
+
+        for (std::size_t k = 0; k < ws.inputs.size(); ++k) {
+            if (!compare( ws.fastOut[k], ws.referenceOut[k] )) {
+                if (ws.mismatches.size() < forAllReported) {
+                    typename result_type::Mismatch m = { begin + k,
+                            ws.inputs[k], ws.fastOut[k], ws.referenceOut[k] };
+                    ws.mismatches.push_back( m );
+                }
+                ++ws.numFailed;
+            }
+        }
+    } );
+
+    result_type result;
+    result.numFailed = 0;
+    result.numChecked = n;
+    result.fastTime = result.referenceTime = std::chrono::nanoseconds::zero();
+    for (auto& ws : state) {
+        result.numFailed += ws.numFailed;
+        result.fastTime += ws.fastTime;
+        result.referenceTime += ws.referenceTime;
+        result.firstMismatches.insert( result.firstMismatches.end(),
+                            ws.mismatches.begin(), ws.mismatches.end() );
+    }
+    std::sort( result.firstMismatches.begin(), result.firstMismatches.end(),
+               []( const typename result_type::Mismatch& l,
+                   const typename result_type::Mismatch& r ) {
+                   return l.index < r.index; } );
+    if (result.firstMismatches.size() > forAllReported)
+        result.firstMismatches.resize( forAllReported );
+    return result;
+}
+
+struct FailRatio {
+    int numFailedTests;
+    int numTests;
+};
+
+// Settings from the command line given to runUnitTests()
+struct Options {
+    unsigned jobs = 1;              // --jobs=n, 0 for one per core
+    bool shuffle = false;           // --shuffle[=seed]
+    std::uint64_t shuffleSeed = 0;
+    bool shuffleSeedGiven = false;  // Else one is picked, as 0 is a seed too
+    bool updateGolden = false;      // --update-golden
+    std::string fixtureCache;       // --fixture-cache=dir
+    bool benchmark = false;         // --benchmark[=pattern]
+    std::string benchmarkPattern;
+    double benchmarkSeconds = 0.5;  // --benchmark-time=seconds
+    bool coldCache = false;         // --cold-cache
+    std::string baseline;           // --baseline=file
+    std::string saveBaseline;       // --save-baseline=file
+    unsigned repeat = 1;            // --repeat=n
+    double benchmarkNoise = 10.;    // --benchmark-noise=percent
+    int pinCpu = -1;                // --pin-cpu[=n], -2 for an isolated one
+    std::string compare;            // --compare=first,second
+    bool verbose = false;           // --verbose
+};
+
+Options& options();
+
+
+// How the tests of a suite may overlap with other tests
+enum class Concurrency {
+    parallel,           // With any test
+    serial,             // With tests of other suites, one of its own at a time
+    exclusive           // With no other test
+};
+
+class Suite {
+public:
+    template <class... Resources>
+    Suite( const char* suiteName, Concurrency c, Resources... resources )
+        : name_( suiteName ),
+          concurrency_( c ),
+          resources_{ std::string( resources )... },
+          setup_( nullptr ),
+          teardown_( nullptr )
+    {}
+
+    void setSetup( TestFunc *tf ) { setup_ = tf; }
+    void setTeardown( TestFunc *tf ) { teardown_ = tf; }
+
+private:
+    friend class UnitTest;
+
+    const char *name_;
+    Concurrency concurrency_;
+    std::vector<std::string> resources_;
+    TestFunc *setup_;
+    TestFunc *teardown_;
+};
+
+// Suite of tests not declared within a TEST_SUITE
+Suite& defaultSuite();
+
+struct SuiteHook {
+    SuiteHook( Suite& suite, TestFunc *tf, bool isSetup )
+    {
+        if (isSetup)
+            suite.setSetup( tf );
+        else
+            suite.setTeardown( tf );
+    }
+};
+
+class UnitTest {
+public:
+    UnitTest( TestFunc *tf, const char* tfName, Suite& suite = defaultSuite() );
+    static FailRatio runUnitTestsImpl();
+
+private:
+    bool callUnitTest();
+    static bool callTest( TestFunc *tf, const char* tfName, bool timeLimited );
+
+    TestFunc *testfunc_;
+    UnitTest *next_;
+    const char *tfname_;
+    Suite *suite_;
+};
+
+// Readable name of a type
+std::string typeName( const std::type_info& type );
+
+// name<type> for each of the types
+std::vector<std::string> instanceNames( const char* name,
+    std::initializer_list<const std::type_info*> types );
+
+// A unit test for each of the Types, from TEMPLATE_TEST, where Instances::
+// get<T>() gives the test for T
+template <class Instances, class... Types>
+class TemplateTest {
+public:
+    TemplateTest( const char* name, Suite& suite )
+        : names_( instanceNames( name, { &typeid( Types )... } ) )
+    {
+        TestFunc* funcs[] = { Instances::template get<Types>()... };
+        for (std::size_t i = 0; i < names_.size(); ++i)
+            tests_.emplace_back( new UnitTest( funcs[i], names_[i].c_str(), suite ) );
+    }
+
+private:
+    std::vector<std::string> names_;
+    std::vector<std::unique_ptr<UnitTest>> tests_;
+};
+
+// The running unit test, as seen from any thread working for it. Failures
+// are recorded here, and the first is rethrown when the test returns.
+class TestContext {
+public:
+    explicit TestContext( const char* name ) : name_( name ), failed_( false ) {}
+
+    const char* name() const { return name_; }
+    bool failed() const { return failed_; }
+    void fail( std::exception_ptr failure );
+    std::exception_ptr firstFailure() const;
+
+    // The test this thread works for, or null
+    static TestContext* current() { return current_; }
+
+    // True, having recorded the failure, if this thread records failed
+    // checks rather than throwing
+    static bool recordFailure();
+
+    // Makes context current on this thread while in scope. A thread that
+    // records does not throw from failed checks, so they fail the test
+    // without ending the thread.
+    class Scope {
+    public:
+        explicit Scope( TestContext* context, bool records = true )
+            : savedContext_( current_ ), savedRecords_( records_ )
+        {
+            current_ = context;
+            records_ = records;
+        }
+        ~Scope()
+        {
+            current_ = savedContext_;
+            records_ = savedRecords_;
+        }
+        Scope( const Scope& ) = delete;
+        Scope& operator=( const Scope& ) = delete;
+    private:
+        TestContext* savedContext_;
+        bool savedRecords_;
+    };
+
+private:
+    static thread_local TestContext* current_;
+    static thread_local bool records_;
+
+    const char* name_;
+    std::atomic<bool> failed_;
+    mutable std::mutex lock_;
+    std::exception_ptr first_;
+};
+
+// A std::thread working for the current unit test. Failed checks and
+// exceptions end the thread and fail the test rather than the program. It
+// is joined when destroyed, and must finish before the test returns.
+class TestThread {
+public:
+    TestThread() = default;
+    template <class F, class... Args>
+    explicit TestThread( F&& f, Args&&... args )
+        : thread_( run<decltype( std::bind( std::forward<F>( f ),
+                                            std::forward<Args>( args )... ) )>,
+                   TestContext::current(),
+                   std::bind( std::forward<F>( f ),
+                              std::forward<Args>( args )... ) )
+    {}
+    TestThread( TestThread&& ) = default;
+    TestThread& operator=( TestThread&& r )
+    {
+        if (thread_.joinable())
+            thread_.join();
+        thread_ = std::move( r.thread_ );
+        return *this;
+    }
+    ~TestThread()
+    {
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    bool joinable() const { return thread_.joinable(); }
+    void join() { thread_.join(); }
+    std::thread::id get_id() const { return thread_.get_id(); }
+
+private:
+    template <class Call>
+    static void run( TestContext* context, Call call )
+    {
+        TestContext::Scope scope( context, false );
+        try {
+            call();
+        }
+        catch( ... ) {
+            if (!context)
+                throw;
+            context->fail( std::current_exception() );
+        }
+    }
+
+    std::thread thread_;
+};
+
+
+#if defined(__cpp_impl_coroutine)
+
+// Asynchronous tests, see TEST_ASYNC
+
+// Runs coroutines on one or more threads. When nothing can run, polled
+// waits are checked and then virtual time (selftest::clock) jumps to the
+// first timer.
+class EventLoop {
+public:
+    // Resumes h, for the current unit test
+    void post( std::coroutine_handle<> h );
+    // Resumes h once virtual time reaches when
+    void postAt( clock::time_point when, std::coroutine_handle<> h );
+    // Resumes h once ready() is true
+    void postWhen( std::function<bool()> ready, std::coroutine_handle<> h );
+
+    // Runs coroutines until none are left waiting
+    void run( unsigned numThreads );
+
+    // The loop running the calling coroutine, which must have one
+    static EventLoop& running();
+
+private:
+    struct Item {
+        std::coroutine_handle<> handle;
+        TestContext* context;
+    };
+    struct Timer {
+        clock::time_point when;
+        std::uint64_t order;        // Equal times resume in order posted
+        Item item;
+        bool operator>( const Timer& r ) const
+        {
+            return when > r.when || (when == r.when && order > r.order);
+        }
+    };
+    struct Poll {
+        std::function<bool()> ready;
+        Item item;
+    };
+
+    void work();
+    void moveDueTimers();
+
+    std::mutex lock_;
+    std::condition_variable changed_;
+    std::deque<Item> ready_;
+    std::vector<Timer> timers_;     // A heap, first due at the front
+    std::vector<Poll> polls_;
+    std::uint64_t numTimers_ = 0;
+    int running_ = 0;
+
+    static thread_local EventLoop* current_;
+};
+
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation;  // Resumed when the task finishes
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <class P>
+        std::coroutine_handle<> await_suspend( std::coroutine_handle<P> h ) noexcept
+        {
+            std::coroutine_handle<> c = h.promise().continuation;
+            return c ? c : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <class T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+    void return_value( T v ) { value.emplace( std::move( v ) ); }
+    T result()
+    {
+        if (error)
+            std::rethrow_exception( error );
+        return std::move( *value );
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    void return_void() {}
+    void result()
+    {
+        if (error)
+            std::rethrow_exception( error );
+    }
+};
+
+// Coroutine returning T, which starts when it is co_awaited
+template <class T = void>
+class Task {
+public:
+    struct promise_type : TaskPromise<T> {
+        Task get_return_object()
+        {
+            return Task( std::coroutine_handle<promise_type>::from_promise( *this ) );
+        }
+    };
+
+    Task( Task&& r ) noexcept : h_( std::exchange( r.h_, nullptr ) ) {}
+    Task( const Task& ) = delete;
+    Task& operator=( const Task& ) = delete;
+    ~Task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> awaiting ) noexcept
+    {
+        h_.promise().continuation = awaiting;
+        return h_;
+    }
+    T await_resume() { return h_.promise().result(); }
+
+private:
+    explicit Task( std::coroutine_handle<promise_type> h ) : h_( h ) {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+class SleepAwaiter {
+public:
+    explicit SleepAwaiter( clock::time_point when ) : when_( when ) {}
+    bool await_ready() const { return when_ <= clock::peek(); }
+    void await_suspend( std::coroutine_handle<> h ) const
+    {
+        EventLoop::running().postAt( when_, h );
+    }
+    void await_resume() const {}
+private:
+    clock::time_point when_;
+};
+
+// co_await these to wait in virtual time, see selftest::clock
+template <class Rep, class Period>
+SleepAwaiter sleepFor( const std::chrono::duration<Rep,Period>& d )
+{
+    return SleepAwaiter( clock::now() +
+                         std::chrono::duration_cast<clock::duration>( d ) );
+}
+inline SleepAwaiter sleepUntil( clock::time_point when )
+{
+    return SleepAwaiter( when );
+}
+
+template <class T>
+class FutureAwaiter {
+public:
+    explicit FutureAwaiter( std::future<T>& future ) : future_( future ) {}
+    bool await_ready() const { return isReady( future_ ); }
+    void await_suspend( std::coroutine_handle<> h )
+    {
+        std::future<T>* future = &future_;
+        EventLoop::running().postWhen( [future] { return isReady( *future ); }, h );
+    }
+    T await_resume() { return future_.get(); }
+private:
+    // Deferred futures are ready, get() runs them
+    static bool isReady( const std::future<T>& f )
+    {
+        return f.wait_for( std::chrono::seconds( 0 ) ) !=
+               std::future_status::timeout;
+    }
+
+    std::future<T>& future_;
+};
+
+// co_await this for the value of a future set by another thread
+template <class T>
+FutureAwaiter<T> awaitFuture( std::future<T>& future )
+{
+    return FutureAwaiter<T>( future );
+}
+
+typedef Task<> AsyncTestFunc();
+
+class AsyncTest {
+public:
+    AsyncTest( AsyncTestFunc *atf, const char* atfName );
+
+    // Starts every async test at once, and runs them all to completion on an
+    // event loop with numThreads threads
+    static FailRatio runAsyncTests( unsigned numThreads );
+
+private:
+    AsyncTestFunc *asyncfunc_;
+    AsyncTest *next_;
+    const char *atfname_;
+
+    static AsyncTest *head_;
+};
+
+#endif      // __cpp_impl_coroutine
+
+
+
+void thrower(
+    const failType ft,
+    const char* failedPredicate,
+    const char* function,
+    const char* fileName,
+    int lineNum );
+
+FailRatio runUnitTests();
+FailRatio runUnitTests( int argc, char* argv[] );
+
+
+// Exception tracing, see TRACETHROWS
+
+// Up to maxFrames return addresses of the calling thread's stack, after
+// skipping the innermost skip frames, or none where that is not supported
+int captureStack( void** frames, int maxFrames, int skip = 0 );
+
+// One line per frame, with symbol names where they can be found
+std::string describeStack( void* const* frames, int numFrames );
+
+// Return addresses saved when an exception was thrown, see STACKTRACES
+struct StackTrace {
+    static const int maxFrames = 32;
+    void* frames[maxFrames];
+    int numFrames = 0;
+
+    std::string describe() const { return describeStack( frames, numFrames ); }
+};
+
+// An exception of type E that also carries the stack it was thrown from
+template<class E>
+class WithStackTrace : public E, public StackTrace {
+public:
+    WithStackTrace( const std::string& arg, const StackTrace& stack )
+        : E(arg), StackTrace(stack), described_( std::make_shared<Described>() ) {};
+
+    // The message, then the stack named only the first time it is asked for.
+    // The exception may be rethrown on several threads, which all share it.
+    const char* what() const noexcept override
+    {
+        if (numFrames == 0 || !described_)
+            return E::what();
+        try {
+            std::call_once( described_->once, [this] {
+                described_->text = std::string(E::what()) + "\n" + describe();
+            } );
+            return described_->text.c_str();
+        }
+        catch( ... ) {
+            return E::what();
+        }
+    }
+
+private:
+    struct Described {
+        std::once_flag once;
+        std::string text;
+    };
+    std::shared_ptr<Described> described_;
+};
+
+// Counts of exceptions thrown, by type and throw site
+class ThrowTracer {
+public:
+    static const int maxFrames = 16;
+
+    // A throw by selftest::thrower()
+    void recordThrower( failType ft, const char* function,
+                        const char* fileName, int lineNum );
+    // Any other throw, from the code at address
+    void recordThrow( const std::type_info& type, const void* address );
+
+    std::uint64_t numThrows() const;
+    // Throw sites, most frequent first, with a sampled stack for the top few
+    void report( std::ostream& os, std::size_t maxSites = 20 ) const;
+
+    // The tracer fed by TRACETHROWS
+    static ThrowTracer& global();
+
+private:
+    struct Key {
+        const void* type;
+        const void* where;
+        int line;
+        bool operator<( const Key& r ) const
+        {
+            return type < r.type || (type == r.type &&
+                (where < r.where || (where == r.where && line < r.line)));
+        }
+    };
+    struct Site {
+        const char* typeName = nullptr;
+        const std::type_info* type = nullptr;
+        const char* function = nullptr;
+        const char* fileName = nullptr;
+        int lineNum = 0;
+        const void* address = nullptr;
+        std::uint64_t count = 0;
+        int numFrames = 0;
+        void* frames[maxFrames];
+    };
+
+    Site& site( const Key& key );
+
+    mutable std::mutex lock_;
+    std::map<Key, Site> sites_;
+};
+
+
+// Floating point comparisons
+
+template <class T>
+struct FloatBits;
+
+template <>
+struct FloatBits<float> {
+    typedef std::int32_t type;
+};
+
+template <>
+struct FloatBits<double> {
+    typedef std::int64_t type;
+};
+
+// Number of representable values between a and b, ignoring NaNs
+template <class T>
+inline typename std::make_unsigned<typename FloatBits<T>::type>::type
+ulpBits( T a, T b )
+{
+    typedef typename FloatBits<T>::type bits_type;
+    typedef typename std::make_unsigned<bits_type>::type ubits_type;
+    const bits_type bitsMin = std::numeric_limits<bits_type>::min();
+    bits_type ia, ib;
+    std::memcpy( &ia, &a, sizeof ia );
+    std::memcpy( &ib, &b, sizeof ib );
+    // Map sign and magnitude onto one line, with -0 and +0 together. The
+    // distance always fits in an unsigned of the same width.
+    bits_type oa = ia < 0 ? bits_type( bitsMin - ia ) : ia;
+    bits_type ob = ib < 0 ? bits_type( bitsMin - ib ) : ib;
+    return oa > ob ? ubits_type( ubits_type( oa ) - ubits_type( ob ) )
+                   : ubits_type( ubits_type( ob ) - ubits_type( oa ) );
+}
+
+// Number of representable values between a and b, or the maximum if
+// either is a NaN
+template <class T>
+inline std::uint64_t ulpDistance( T a, T b )
+{
+    return (a != a || b != b) ? std::numeric_limits<std::uint64_t>::max()
+                              : ulpBits( a, b );
+}
+
+// Largest difference allowed between a and b by CHECK_NEAR
+template <class T>
+inline T nearTolerance( T a, T b, T absTol, T relTol )
+{
+    T fa = std::fabs( a );
+    T fb = std::fabs( b );
+    T rel = relTol * (fa > fb ? fa : fb);
+    return absTol > rel ? absTol : rel;
+}
+
+template <class T>
+inline bool near( T a, T b, T absTol, T relTol )
+{
+    return (a == b) | (std::fabs( a-b ) <= nearTolerance( a, b, absTol, relTol ));
+}
+
+// The bulk kernels below are branch free and count in a type as wide as
+// the elements, one block at a time, so that compilers vectorize them (gcc
+// and clang do at -O3)
+const std::size_t floatCheckBlock = 4096;
+
+template <class T>
+std::uint64_t countNotNear( const T* a, const T* b, std::size_t n,
+                            T absTol, T relTol )
+{
+    std::uint64_t total = 0;
+    for (std::size_t begin = 0; begin < n; begin += floatCheckBlock) {
+        std::size_t end = std::min( n, begin + floatCheckBlock );
+        T count = 0;
+        for (std::size_t i = begin; i < end; ++i)
+            count += near( a[i], b[i], absTol, relTol ) ? T( 0 ) : T( 1 );
+        total += std::uint64_t( count );
+    }
+    return total;
+}
+
+template <class T>
+std::uint64_t countUlpsOver( const T* a, const T* b, std::size_t n,
+                             std::uint64_t maxUlps )
+{
+    typedef typename std::make_unsigned<typename FloatBits<T>::type>::type
+            count_type;
+    const count_type limit = std::min<std::uint64_t>( maxUlps,
+                                std::numeric_limits<count_type>::max() );
+    std::uint64_t total = 0;
+    for (std::size_t begin = 0; begin < n; begin += floatCheckBlock) {
+        std::size_t end = std::min( n, begin + floatCheckBlock );
+        count_type count = 0;
+        for (std::size_t i = begin; i < end; ++i)
+            count += (ulpBits( a[i], b[i] ) > limit) |
+                     (a[i] != a[i]) | (b[i] != b[i]);
+        total += count;
+    }
+    return total;
+}
+
+// Failure text for CHECK_NEAR and CHECK_ULP
+std::string describeNear( double a, double b, double absTol, double relTol );
+std::string describeUlp( double a, double b, std::uint64_t ulps,
+                         std::uint64_t maxUlps );
+
+// Result of checkAllNear() and checkAllUlp()
+struct FloatCheckResult {
+    static const int numBuckets = 66;
+
+    std::uint64_t numFailed;
+    std::uint64_t numChecked;
+    std::size_t worstIndex;
+    double worstA;
+    double worstB;
+    double worstError;
+    // Bucket 0 is within tolerance, bucket k errors up to 2^k times the
+    // tolerance (or 2^k ulps), the last bucket infinities and NaNs
+    std::uint64_t histogram[numBuckets];
+
+    explicit FloatCheckResult( std::uint64_t n );
+    void record( std::size_t i, double a, double b, double error, int bucket );
+    std::string describe( const char* errorName ) const;
+};
+
+template <class T>
+FloatCheckResult checkAllNear( const T* a, const T* b, std::size_t n,
+                               T absTol, T relTol )
+{
+    FloatCheckResult result( n );
+    if (!countNotNear( a, b, n, absTol, relTol ))
+        return result;
+
+    // Only failures pay for the histogram
+    for (std::size_t i = 0; i < n; ++i) {
+        T error = std::fabs( a[i]-b[i] );
+        T tolerance = nearTolerance( a[i], b[i], absTol, relTol );
+        int bucket = FloatCheckResult::numBuckets - 1;
+        if (near( a[i], b[i], absTol, relTol )) {
+            bucket = 0;
+        } else if (error == error && tolerance > T( 0 ) &&
+                   error/tolerance < std::ldexp( 1., 64 )) {
+            bucket = std::ilogb( error/tolerance ) + 1;
+        } else if (error == error && error < std::numeric_limits<T>::infinity()) {
+            bucket = FloatCheckResult::numBuckets - 2;
+        }
+        result.record( i, a[i], b[i], error == error ? error :
+                            std::numeric_limits<double>::infinity(), bucket );
+    }
+    return result;
+}
+
+template <class T>
+FloatCheckResult checkAllUlp( const T* a, const T* b, std::size_t n,
+                              std::uint64_t maxUlps )
+{
+    FloatCheckResult result( n );
+    if (!countUlpsOver( a, b, n, maxUlps ))
+        return result;
+
+    // Only failures pay for the histogram
+    for (std::size_t i = 0; i < n; ++i) {
+        std::uint64_t d = ulpDistance( a[i], b[i] );
+        int bucket = 0;
+        if (d == std::numeric_limits<std::uint64_t>::max())
+            bucket = FloatCheckResult::numBuckets - 1;
+        else if (d > maxUlps)
+            for (bucket = 1; bucket < 64 && (std::uint64_t( 1 ) << bucket) < d; )
+                ++bucket;
+        result.record( i, a[i], b[i], double( d ), bucket );
+    }
+    return result;
+}
+
+
+// Property based testing
+
+// Small, fast and deterministic random numbers (splitmix64)
+class Rng {
+public:
+    explicit Rng( std::uint64_t seed ) : state_( seed ) {}
+
+    std::uint64_t next()
+    {
+        std::uint64_t z = (state_ += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0,n), or any value if n is zero
+    std::uint64_t below( std::uint64_t n ) { return n ? next() % n : next(); }
+
+    // Uniform in [0,1)
+    double uniform() { return (next() >> 11) * (1. / 9007199254740992.); }
+
+private:
+    std::uint64_t state_;
+};
+
+
+// Generators have a value_type, create values with gen( rng ) and give
+// the k'th simpler alternative to a value with gen.shrink( v, k, out ),
+// returning false when there are no more.
+
+template <class T>
+class IntegerGen {
+public:
+    typedef T value_type;
+
+    IntegerGen( T lo, T hi ) : lo_( lo ), hi_( hi ) {}
+
+    T operator()( Rng& rng ) const
+    {
+        // One value in eight is from the edges, where the bugs live
+        if (rng.below( 8 ) == 0) {
+            switch (rng.below( 4 )) {
+            case 0:  return lo_;
+            case 1:  return hi_;
+            case 2:  return target();
+            default: return target() < hi_ ? T( target() + 1 ) : target();
+            }
+        }
+        std::uint64_t span = std::uint64_t( hi_ ) - std::uint64_t( lo_ );
+        return T( std::uint64_t( lo_ ) + rng.below( span + 1 ) );
+    }
+
+    // Candidates step towards zero: 0, v/2, 3v/4, ... v-1
+    bool shrink( const T& v, unsigned k, T& out ) const
+    {
+        T t = target();
+        std::uint64_t distance = v < t ? std::uint64_t( t ) - std::uint64_t( v )
+                                       : std::uint64_t( v ) - std::uint64_t( t );
+        if (k >= 64 || (distance >> k) == 0)
+            return false;
+        out = v < t ? T( std::uint64_t( v ) + (distance >> k) )
+                    : T( std::uint64_t( v ) - (distance >> k) );
+        return true;
+    }
+
+private:
+    T target() const { return lo_ > T( 0 ) ? lo_ : hi_ < T( 0 ) ? hi_ : T( 0 ); }
+
+    T lo_;
+    T hi_;
+};
+
+// Integers in [lo,hi]
+template <class T>
+IntegerGen<T> integers( T lo = std::numeric_limits<T>::min(),
+                        T hi = std::numeric_limits<T>::max() )
+{
+    static_assert( std::is_integral<T>::value, "integers() needs integers" );
+    return IntegerGen<T>( lo, hi );
+}
+
+template <class T>
+class RealGen {
+public:
+    typedef T value_type;
+
+    RealGen( T lo, T hi ) : lo_( lo ), hi_( hi ) {}
+
+    T operator()( Rng& rng ) const
+    {
+        if (rng.below( 8 ) == 0) {
+            switch (rng.below( 3 )) {
+            case 0:  return lo_;
+            case 1:  return hi_;
+            default: return target();
+            }
+        }
+        T v = lo_ + T( rng.uniform() ) * (hi_ - lo_);
+        return v > hi_ ? hi_ : v;
+    }
+
+    // Candidates halve the distance to zero each step
+    bool shrink( const T& v, unsigned k, T& out ) const
+    {
+        T t = target();
+        if (k > 60 || !(v != t))
+            return false;
+        out = k == 0 ? t : T( v - (v - t) * std::ldexp( T( 1 ), -int( k ) ) );
+        return out != v;
+    }
+
+private:
+    T target() const { return lo_ > T( 0 ) ? lo_ : hi_ < T( 0 ) ? hi_ : T( 0 ); }
+
+    T lo_;
+    T hi_;
+};
+
+// Reals in [lo,hi]
+template <class T>
+RealGen<T> reals( T lo, T hi )
+{
+    static_assert( std::is_floating_point<T>::value, "reals() needs reals" );
+    return RealGen<T>( lo, hi );
+}
+
+class BoolGen {
+public:
+    typedef bool value_type;
+
+    bool operator()( Rng& rng ) const { return rng.next() & 1; }
+
+    bool shrink( const bool& v, unsigned k, bool& out ) const
+    {
+        out = false;
+        return v && k == 0;
+    }
+};
+
+inline BoolGen booleans()
+{
+    return BoolGen();
+}
+
+template <class T>
+class ConstGen {
+public:
+    typedef T value_type;
+
+    explicit ConstGen( const T& v ) : v_( v ) {}
+    const T& operator()( Rng& ) const { return v_; }
+    bool shrink( const T&, unsigned, T& ) const { return false; }
+
+private:
+    T v_;
+};
+
+// Always v
+template <class T>
+ConstGen<T> just( const T& v )
+{
+    return ConstGen<T>( v );
+}
+
+template <class G>
+class VectorGen {
+public:
+    typedef std::vector<typename G::value_type> value_type;
+
+    VectorGen( const G& gen, std::size_t maxSize )
+        : gen_( gen ), maxSize_( maxSize ) {}
+
+    value_type operator()( Rng& rng ) const
+    {
+        // The size is drawn first, so the order rng is used in is fixed
+        std::size_t size = std::size_t( rng.below( maxSize_ + 1 ) );
+        value_type v;
+        v.reserve( size );
+        for (std::size_t i = 0; i < size; ++i)
+            v.push_back( gen_( rng ) );
+        return v;
+    }
+
+    // Candidates first drop one element, then shrink one element
+    bool shrink( const value_type& v, unsigned k, value_type& out ) const
+    {
+        out = v;
+        if (k < v.size()) {
+            out.erase( out.begin() + k );
+            return true;
+        }
+        k -= unsigned( v.size() );
+        for (std::size_t i = 0; i < v.size(); ++i) {
+            for (unsigned j = 0; gen_.shrink( v[i], j, out[i] ); ++j) {
+                if (k-- == 0)
+                    return true;
+            }
+            out[i] = v[i];
+        }
+        return false;
+    }
+
+private:
+    G gen_;
+    std::size_t maxSize_;
+};
+
+// Vectors of up to maxSize values from gen
+template <class G>
+VectorGen<G> vectorsOf( const G& gen, std::size_t maxSize = 100 )
+{
+    return VectorGen<G>( gen, maxSize );
+}
+
+template <class G, class F>
+class MapGen {
+public:
+    typedef typename std::decay<
+        decltype( std::declval<F>()( std::declval<typename G::value_type>() ) )
+        >::type value_type;
+
+    MapGen( const G& gen, F f ) : gen_( gen ), f_( f ) {}
+    value_type operator()( Rng& rng ) const { return f_( gen_( rng ) ); }
+    bool shrink( const value_type&, unsigned, value_type& ) const { return false; }
+
+private:
+    G gen_;
+    F f_;
+};
+
+// f( x ) for x from gen. These values are not shrunk.
+template <class G, class F>
+MapGen<G,F> map( const G& gen, F f )
+{
+    return MapGen<G,F>( gen, f );
+}
+
+template <class G, class P>
+class FilterGen {
+public:
+    typedef typename G::value_type value_type;
+
+    FilterGen( const G& gen, P pred ) : gen_( gen ), pred_( pred ) {}
+
+    value_type operator()( Rng& rng ) const
+    {
+        for (int tries = 0; tries < 100; ++tries) {
+            value_type v = gen_( rng );
+            if (pred_( v ))
+                return v;
+        }
+        TEST_FAIL( "filter() rejected 100 values in a row" );
+        return gen_( rng );
+    }
+
+    bool shrink( const value_type& v, unsigned k, value_type& out ) const
+    {
+        for (unsigned j = 0; gen_.shrink( v, j, out ); ++j) {
+            if (pred_( out ) && k-- == 0)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    G gen_;
+    P pred_;
+};
+
+// Values from gen for which pred is true
+template <class G, class P>
+FilterGen<G,P> filter( const G& gen, P pred )
+{
+    return FilterGen<G,P>( gen, pred );
+}
+
+
+template <std::size_t... I>
+struct Indices {};
+
+template <std::size_t N, std::size_t... I>
+struct MakeIndices : MakeIndices<N-1, N-1, I...> {};
+
+template <std::size_t... I>
+struct MakeIndices<0, I...> {
+    typedef Indices<I...> type;
+};
+
+template <class... G>
+class TupleGen {
+public:
+    typedef std::tuple<typename G::value_type...> value_type;
+
+    explicit TupleGen( const std::tuple<G...>& gens ) : gens_( gens ) {}
+
+    value_type operator()( Rng& rng ) const
+    {
+        return generate( rng, typename MakeIndices<sizeof...(G)>::type() );
+    }
+
+    // Candidates shrink the first element, then the second, ...
+    bool shrink( const value_type& v, unsigned k, value_type& out ) const
+    {
+        return shrinkFrom( v, k, out,
+                           std::integral_constant<std::size_t, 0>() );
+    }
+
+private:
+    template <std::size_t... I>
+    value_type generate( Rng& rng, Indices<I...> ) const
+    {
+        // Braced initializers are evaluated left to right, so the values
+        // depend only on the seed
+        return value_type{ std::get<I>( gens_ )( rng )... };
+    }
+
+    template <std::size_t I>
+    bool shrinkFrom( const value_type& v, unsigned k, value_type& out,
+                     std::integral_constant<std::size_t, I> ) const
+    {
+        out = v;
+        for (unsigned j = 0;
+             std::get<I>( gens_ ).shrink( std::get<I>( v ), j, std::get<I>( out ) );
+             ++j) {
+            if (k-- == 0)
+                return true;
+        }
+        out = v;
+        return shrinkFrom( v, k, out,
+                           std::integral_constant<std::size_t, I+1>() );
+    }
+
+    bool shrinkFrom( const value_type&, unsigned, value_type&,
+                     std::integral_constant<std::size_t, sizeof...(G)> ) const
+    {
+        return false;
+    }
+
+    std::tuple<G...> gens_;
+};
+
+// Tuples of values, one from each gen
+template <class... G>
+TupleGen<G...> tuples( const G&... gens )
+{
+    return TupleGen<G...>( std::make_tuple( gens... ) );
+}
+
+
+// Function type of a property taking values from a tuple of generators
+template <class Gens>
+struct PropertyFunction;
+
+template <class... G>
+struct PropertyFunction< std::tuple<G...> > {
+    typedef void type( typename G::value_type... );
+};
+
+template <class F, class Tuple, std::size_t... I>
+void applyTuple( F& f, const Tuple& t, Indices<I...> )
+{
+    f( std::get<I>( t )... );
+}
+
+template <class Tuple, std::size_t... I>
+void printTuple( std::ostream& os, const Tuple& t, Indices<I...> )
+{
+    int expand[] = { 0, (os << (I ? ", " : ""), printValue( os, std::get<I>( t ) ), 0)... };
+    (void)expand;
+}
+
+// While one of these exists, failing checks on this thread are silent
+class QuietFailures {
+public:
+    QuietFailures() : saved_( quiet() ) { quiet() = true; }
+    ~QuietFailures() { quiet() = saved_; }
+    static bool& quiet();
+private:
+    bool saved_;
+};
+
+// While one of these exists, the notes and reports this thread would write
+// on std::cout and std::clog go to the given stream instead, so that tests
+// can check them
+class CaptureReports {
+public:
+    explicit CaptureReports( std::ostream& to ) : saved_( capture() ) { capture() = &to; }
+    ~CaptureReports() { capture() = saved_; }
+    CaptureReports( const CaptureReports& ) = delete;
+    CaptureReports& operator=( const CaptureReports& ) = delete;
+    static std::ostream*& capture();
+private:
+    std::ostream* saved_;
+};
+
+// The stream capturing this thread's reports, or else usual
+std::ostream& reportStream( std::ostream& usual );
+
+const std::uint64_t propertyCases = 1000;   // Default cases per property
+const unsigned propertyShrinks = 1000;      // Limit on shrinking steps
+
+// Seed for a test, derived from its name and the --shuffle seed
+std::uint64_t testSeed( const char* name );
+
+// Random numbers for the running test, seeded with testSeed( its name )
+Rng& testRng();
+
+template <class F, class Tuple, class Idx>
+bool propertyHolds( F& f, const Tuple& args, Idx idx )
+{
+    QuietFailures quiet;
+    try {
+        applyTuple( f, args, idx );
+        return true;
+    }
+    catch( ... ) {
+        return false;
+    }
+}
+
+// Checks f for n cases from gens, shrinking the first that fails and
+// reporting it with note()
+template <class... G, class F>
+void checkProperty( const char* name, const std::tuple<G...>& gens, F& f,
+                    std::uint64_t n, const char* fileName, int lineNum )
+{
+    typedef TupleGen<G...> gen_type;
+    typedef typename gen_type::value_type args_type;
+    typedef typename MakeIndices<sizeof...(G)>::type indices;
+    gen_type gen( gens );
+    std::uint64_t seed = testSeed( name );
+    auto caseRng = [=]( std::uint64_t i ) {
+        return Rng( seed ^ (i * 0xd1342543de82ef95ull) );
+    };
+
+    std::atomic<std::uint64_t> firstFailure( n );
+    parallelFor( n, 64,
+            [&]( std::uint64_t begin, std::uint64_t end, unsigned ) {
+        for (std::uint64_t i = begin; i < end && i < firstFailure; ++i) {
+            Rng rng = caseRng( i );
+            if (!propertyHolds( f, gen( rng ), indices() )) {
+                std::uint64_t current = firstFailure.load();
+                while (i < current &&
+                       !firstFailure.compare_exchange_weak( current, i ))
+                    ;
+                return;
+            }
+        }
+    } );
+    if (firstFailure == n)
+        return;
+
+    Rng rng = caseRng( firstFailure );
+    const args_type original = gen( rng );
+    args_type smallest = original;
+    args_type candidate = original;
+    unsigned steps = 0;
+    bool shrunk = true;
+    while (shrunk && steps < propertyShrinks) {
+        shrunk = false;
+        for (unsigned k = 0; gen.shrink( smallest, k, candidate ); ++k) {
+            if (!propertyHolds( f, candidate, indices() )) {
+                smallest = candidate;
+                ++steps;
+                shrunk = true;
+                break;
+            }
+        }
+    }
+
+    // Run the counterexample once more, out loud this time
+    try {
+        applyTuple( f, smallest, indices() );
+    }
+    catch( ... ) {
+        std::ostringstream os;
+        os << "property " << name << " falsified by case " << firstFailure
+           << " of " << n << " (seed 0x" << std::hex << seed << std::dec
+           << "), counterexample (";
+        printTuple( os, smallest, indices() );
+        os << ")";
+        if (steps) {
+            os << " shrunk in " << steps << " steps from (";
+            printTuple( os, original, indices() );
+            os << ")";
+        }
+        note( os.str().c_str(), fileName, lineNum );
+        throw;
+    }
+    thrower( failType::badunittest, "property result is not repeatable",
+             name, fileName, lineNum );
+}
+
+
+// Golden files
+
+// Result of checkGolden()
+struct GoldenResult {
+    bool matches;
+    bool updated;               // The golden file was rewritten
+    std::string problem;        // Why it does not match
+
+    std::string describe() const { return ": " + problem; }
+};
+
+GoldenResult checkGoldenBytes( const void* data, std::size_t size,
+                               const std::string& path );
+
+// Compares anything with data() and size() to a golden file
+template <class Buffer>
+GoldenResult checkGolden( const Buffer& buffer, const std::string& path )
+{
+    return checkGoldenBytes( buffer.data(), buffer.size() * sizeof *buffer.data(),
+                             path );
+}
+
+// Offset of the first byte that differs, or size if there are none
+std::size_t firstMismatch( const unsigned char* a, const unsigned char* b,
+                           std::size_t size );
+
+
+// Fixtures
+
+// A read only array, which may be mapped from a file
+template <class T>
+class FixtureArray {
+public:
+    FixtureArray( const T* data, std::size_t size ) : data_( data ), size_( size ) {}
+
+    const T* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+    const T& operator[]( std::size_t i ) const { return data_[i]; }
+
+private:
+    const T* data_;
+    std::size_t size_;
+};
+
+struct FixtureBytes {
+    const void* data;
+    std::size_t size;
+};
+
+// Bytes of a fixture from the cache, if it has them for this version, or
+// else from build() which are then saved to the cache. The bytes live
+// until the program ends.
+FixtureBytes cachedFixtureBytes(
+    const char* name,
+    const char* version,
+    std::size_t elementSize,
+    const std::function<void( std::vector<unsigned char>& )>& build );
+
+template <class T, class Build>
+FixtureArray<T> cachedFixture( const char* name, const char* version,
+                               Build build )
+{
+    static_assert( std::is_trivially_copyable<T>::value,
+                   "cached fixtures must be arrays of plain data" );
+    FixtureBytes bytes = cachedFixtureBytes( name, version, sizeof(T),
+            [&]( std::vector<unsigned char>& out ) {
+                std::vector<T> v = build();
+                const unsigned char* p =
+                        reinterpret_cast<const unsigned char*>( v.data() );
+                out.assign( p, p + v.size()*sizeof(T) );
+            } );
+    return FixtureArray<T>( static_cast<const T*>( bytes.data ),
+                            bytes.size / sizeof(T) );
+}
+
+
+// Fuzzing
+
+typedef void FuzzFunc( const std::uint8_t* data, std::size_t size );
+
+class FuzzTarget {
+public:
+    FuzzTarget( FuzzFunc *ff, const char* ffName );
+
+    // Runs the selected fuzz target on one input, aborting if it fails
+    static void fuzzOne( const std::uint8_t* data, std::size_t size );
+
+private:
+    FuzzFunc *fuzzfunc_;
+    FuzzTarget *next_;
+    const char *ffname_;
+
+    static FuzzTarget *head_;
+};
+
+// Runs every file in the saved corpus of a fuzz target through it
+void replayCorpus( FuzzFunc *ff, const char* ffName );
+
+
+// Concurrent tests
+
+typedef void ConcurrentFunc( unsigned thread, std::size_t iteration );
+
+// Calls cf( thread, i ) for each i in [0,iterations) on each of numThreads
+// threads started together, rethrowing the first failure once all have
+// stopped
+void runConcurrent( ConcurrentFunc *cf, const char* cfName,
+                    unsigned numThreads, std::size_t iterations,
+                    const char* fileName, int lineNum );
+
+
+// Benchmarks
+
+// Keeps the compiler from optimizing away the computation of value
+template <class T>
+inline void doNotOptimize( const T& value )
+{
+#if defined(__GNUC__)
+    asm volatile( "" : : "r,m"( value ) : "memory" );
+#else
+    static thread_local const void* volatile sink;
+    sink = &value;
+#endif
+}
+
+// Calls op, keeping its result if it has one
+template <class Op, class... Args>
+inline auto callAndKeep( Op& op, Args&... args ) ->
+    typename std::enable_if<std::is_void<decltype( op( args... ) )>::value>::type
+{
+    op( args... );
+}
+
+template <class Op, class... Args>
+inline auto callAndKeep( Op& op, Args&... args ) ->
+    typename std::enable_if<!std::is_void<decltype( op( args... ) )>::value>::type
+{
+    doNotOptimize( op( args... ) );
+}
+
+// Time for benchmarks, in ticks of the fastest clock there is. That is the
+// time stamp counter, on x86 processors where it runs at a constant rate,
+// and otherwise std::chrono::steady_clock in nanoseconds. calibrate() chooses,
+// and must be called before timing.
+class BenchClock {
+public:
+    static void calibrate();
+
+    // Time at the start of what is timed, and at the end of it. The fences
+    // keep the code timed between them.
+    static std::uint64_t start()
+    {
+#ifdef SELFTEST_HAS_TSC
+        if (tsc_.load( std::memory_order_relaxed )) {
+            _mm_lfence();
+            std::uint64_t t = __rdtsc();
+            _mm_lfence();
+            return t;
+        }
+#endif
+        return steadyNanos();
+    }
+    static std::uint64_t stop()
+    {
+#ifdef SELFTEST_HAS_TSC
+        if (tsc_.load( std::memory_order_relaxed )) {
+            unsigned aux;
+            std::uint64_t t = __rdtscp( &aux );
+            _mm_lfence();
+            return t;
+        }
+#endif
+        return steadyNanos();
+    }
+
+    static bool usesTsc() { return tsc_; }
+    static double nanosPerTick() { return nanosPerTick_; }
+    // Ticks taken by start() and stop(), which timings subtract
+    static double overheadTicks() { return overheadTicks_; }
+    // The clock, its rate and overhead
+    static std::string describe();
+
+private:
+    static std::uint64_t steadyNanos()
+    {
+        return std::uint64_t( std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch() ).count() );
+    }
+    static double measureOverhead();
+
+    static std::atomic<bool> tsc_;
+    static double nanosPerTick_;
+    static double overheadTicks_;
+};
+
+// Counts of values, in buckets no wider than 1/128 of the values in them (the
+// layout of an HDR histogram), so that any value from 0 to 2^64-1 can be
+// recorded in a fixed 58kB and percentiles are within 0.4%
+class Histogram {
+public:
+    static const int subBucketBits = 8;
+    static const std::size_t numBuckets =
+            (64 - subBucketBits + 2) << (subBucketBits-1);
+
+    Histogram() : counts_( numBuckets, 0 ) {}
+
+    void record( std::uint64_t value, std::uint64_t count = 1 );
+    // Adds the values recorded by another histogram
+    Histogram& operator+=( const Histogram& r );
+    bool operator==( const Histogram& r ) const;
+    bool operator!=( const Histogram& r ) const { return !(*this == r); }
+
+    // A compact form of the histogram, with runs of empty buckets skipped
+    std::string serialize() const;
+    static Histogram deserialize( const std::string& bytes );
+    // The same as text, for baseline files
+    std::string toBase64() const;
+    static Histogram fromBase64( const std::string& text );
+
+    std::uint64_t count() const { return total_; }
+    std::uint64_t min() const { return total_ ? min_ : 0; }
+    std::uint64_t max() const { return max_; }
+    double mean() const { return total_ ? sum_ / total_ : 0.; }
+    // The value that p percent of values are no greater than, give or take
+    // the width of its bucket, except the exact min() and max() for 0 and 100
+    std::uint64_t percentile( double p ) const;
+
+    static std::size_t bucketOf( std::uint64_t value );
+    static std::uint64_t bucketLow( std::size_t bucket );
+    static std::uint64_t bucketHigh( std::size_t bucket );
+
+private:
+    friend class SharedHistogram;
+
+    std::vector<std::uint64_t> counts_;
+    std::uint64_t total_ = 0;
+    std::uint64_t min_ = ~std::uint64_t( 0 );
+    std::uint64_t max_ = 0;
+    double sum_ = 0.;
+};
+
+// A Histogram that any number of threads record in at once. Each thread
+// records in a shard of its own, without locking after its first value, and
+// the shards are added up by snapshot().
+class SharedHistogram {
+public:
+    SharedHistogram() = default;
+    SharedHistogram( const SharedHistogram& ) = delete;
+    SharedHistogram& operator=( const SharedHistogram& ) = delete;
+
+    void record( std::uint64_t value );
+    Histogram snapshot() const;
+
+private:
+    struct Shard {
+        // Written only by the shard's thread
+        Shard() : counts( Histogram::numBuckets ) {}
+        std::vector<std::atomic<std::uint64_t>> counts;
+        std::atomic<std::uint64_t> min { ~std::uint64_t( 0 ) };
+        std::atomic<std::uint64_t> max { 0 };
+        std::atomic<double> sum { 0. };
+        std::thread::id owner = std::this_thread::get_id();
+    };
+    Shard& shard();
+
+    const std::uint64_t id_ = nextId()++;
+    mutable std::mutex lock_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    static std::atomic<std::uint64_t>& nextId();
+};
+
+std::string encodeBase64( const std::string& bytes );
+std::string decodeBase64( const std::string& text );
+
+// Time to three digits, in the largest unit it is at least one of
+std::string describeNanos( double nanos );
+
+// Usual percentiles of a histogram of times in units of unitNanos
+std::string describePercentiles( const Histogram& h, double unitNanos );
+
+// Bounds for CHECK_LATENCY, written as p99 <= std::chrono::microseconds( 5 )
+namespace latency {
+
+struct Percentile {
+    double p;
+};
+
+struct Bound {
+    double p;
+    std::chrono::nanoseconds limit;
+};
+
+template <class Rep, class Period>
+Bound operator<=( Percentile q, const std::chrono::duration<Rep,Period>& d )
+{
+    return Bound{ q.p, std::chrono::duration_cast<std::chrono::nanoseconds>( d ) };
+}
+
+const Percentile p50 = { 50. };
+const Percentile p90 = { 90. };
+const Percentile p99 = { 99. };
+const Percentile p999 = { 99.9 };
+const Percentile p9999 = { 99.99 };
+const Percentile p100 = { 100. };
+
+#if __cplusplus >= 201402L
+using namespace std::chrono_literals;     // p99 <= 5us
+#endif
+
+}   // namespace latency
+
+// Result of checkLatency()
+struct LatencyResult {
+    Histogram nanos;                        // Of each call
+    std::vector<latency::Bound> exceeded;
+    std::string describe() const;
+};
+
+// Times iterations calls of op, one at a time, after a tenth as many
+// untimed ones to warm up
+template <class Op>
+LatencyResult checkLatency( Op op, std::uint64_t iterations,
+                            std::initializer_list<latency::Bound> bounds )
+{
+    for (std::uint64_t i = 0; i < iterations/10; ++i)
+        callAndKeep( op );
+
+    LatencyResult result;
+    BenchClock::calibrate();
+    const double overhead = BenchClock::overheadTicks();
+    const double nanosPerTick = BenchClock::nanosPerTick();
+    for (std::uint64_t i = 0; i < iterations; ++i) {
+        std::uint64_t start = BenchClock::start();
+        callAndKeep( op );
+        double ticks = double( BenchClock::stop() - start ) - overhead;
+        result.nanos.record( std::uint64_t( std::max( 0., ticks*nanosPerTick ) ) );
+    }
+    for (auto& b : bounds) {
+        if (result.nanos.percentile( b.p ) > std::uint64_t( b.limit.count() ))
+            result.exceeded.push_back( b );
+    }
+    return result;
+}
+
+// Memory allocated by the calling thread, counted by operator new and
+// delete when TRACKALLOCATIONS is defined with SELFTEST_IMPLEMENTATION
+struct AllocationCounts {
+    std::uint64_t allocations;
+    std::uint64_t bytes;            // Allocated in all
+    std::int64_t liveBytes;         // Allocated less freed by this thread
+    std::int64_t peakBytes;         // Most live since resetAllocationPeak()
+};
+
+bool trackingAllocations();
+AllocationCounts allocationCounts();
+void resetAllocationPeak();
+
+// Lets two benchmarks, each on its own thread, take turns timing blocks of
+// calls, so that drift in the machine's speed affects both alike
+class BenchmarkTurns {
+public:
+    // Waits for side's turn, or returns false when there are no more
+    bool await( int side );
+    // Ends side's turn, which took picosPerCall
+    void done( int side, double picosPerCall );
+
+    // Gives side a turn and waits for it to end, or returns false if its
+    // benchmark finished without one
+    bool take( int side, double* picosPerCall );
+    // Side's benchmark function has returned
+    void finish( int side );
+    // No more turns
+    void stop();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    int turn_ = -1;
+    bool waiting_[2] = { false, false };
+    bool finished_[2] = { false, false };
+    bool stopped_ = false;
+    double picos_[2] = { 0., 0. };
+};
+
+// State of a benchmark, given to its function
+class Benchmark {
+public:
+    Benchmark( const char* name, double seconds );
+
+    // Times op, called in batches long enough for the clock to time well,
+    // for the benchmark's time. A result of op is kept from being optimized
+    // away.
+    template <class Op>
+    void run( Op op );
+    // Times op( input ) the same way, each call on its own input from
+    // setup(). The inputs for a batch are made before it is timed.
+    template <class Setup, class Op>
+    void run( Setup setup, Op op );
+
+    // Stop and start the clock during op, for work that is not to be timed,
+    // and whose allocations are not counted. Each pause reads the clock
+    // twice, which run( setup, op ) avoids.
+    void pauseTiming()
+    {
+        pausedAt_ = BenchClock::stop();
+        pausedCounts_ = allocationCounts();
+    }
+    void resumeTiming()
+    {
+        AllocationCounts counts = allocationCounts();
+        pausedAllocations_ += counts.allocations - pausedCounts_.allocations;
+        pausedBytes_ += counts.bytes - pausedCounts_.bytes;
+        pausedTicks_ += double( BenchClock::start() - pausedAt_ ) +
+                        BenchClock::overheadTicks();
+    }
+
+    // Also times single calls of op with nothing in the caches, which is
+    // on with --cold-cache
+    void coldCache( bool cold ) { cold_ = cold; }
+    // For cold calls, flush just these bytes from the caches rather than
+    // evicting everything
+    void coldInput( const void* data, std::size_t size )
+    {
+        coldInputs_.push_back( std::make_pair( data, size ) );
+    }
+
+    // How much each call of op processes, to report as a rate
+    void setBytesProcessed( double perCall ) { bytes_ = perCall; }
+    void setItemsProcessed( double perCall ) { items_ = perCall; }
+    // A count op adds to, such as cache hits, reported per call and per
+    // second. Names have no spaces, and the reference is best taken before
+    // run() as finding it is not free.
+    double& counter( const std::string& name ) { return counters_[name]; }
+
+    // Calls the benchmark function again for each of the sizes, returning
+    // the one for this call, which is added to the benchmark's name
+    std::size_t workloadSize( std::initializer_list<std::size_t> sizes );
+    std::size_t workloadSize() const { return size_; }   // 0 if none
+
+    const char* name() const { return name_.c_str(); }
+    std::uint64_t iterations() const { return iterations_; }
+    // Every call of op, including those warming up and not timed
+    std::uint64_t calls() const { return calls_; }
+    double bytesProcessed() const { return bytes_; }
+    double itemsProcessed() const { return items_; }
+    const std::map<std::string, double>& counters() const { return counters_; }
+    // Allocations while timed, with TRACKALLOCATIONS
+    double allocationsPerOp() const
+    {
+        return timedCalls_ ? double( allocations_ ) / double( timedCalls_ ) : 0.;
+    }
+    double allocatedBytesPerOp() const
+    {
+        return timedCalls_ ? double( allocatedBytes_ ) / double( timedCalls_ ) : 0.;
+    }
+    // Most allocated and not yet freed during a batch
+    std::uint64_t peakBytes() const { return peakBytes_; }
+    // Picoseconds per call, of each batch
+    const Histogram& samples() const { return samples_; }
+    // Picoseconds of each cold call, if they were timed
+    const Histogram& coldSamples() const { return coldSamples_; }
+    double nanosPerOp() const { return samples_.percentile( 50. ) / 1000.; }
+    // Spread of the middle 80% of samples, relative to the median
+    double noise() const { return noiseOf( samples_ ); }
+    bool noisy() const { return noise()*100. > options().benchmarkNoise; }
+    double coldNanosPerOp() const { return coldSamples_.percentile( 50. ) / 1000.; }
+    std::string describe() const;
+    std::string describeCold() const;      // "" if not timed cold
+    std::string describeThroughput() const;   // "" if nothing processed
+
+    static double noiseOf( const Histogram& samples );
+
+    static const std::uint64_t minBatchNanos = 10000;
+    static const std::uint64_t minBatches = 10;    // However slow the setup
+    static const std::uint64_t maxSamples = 100000;
+    static const int noiseRetries = 2;      // Times more a noisy run is tried
+    static const std::uint64_t maxColdSamples = 10000;
+    static const std::uint64_t minColdSamples = 3;
+
+    static const std::uint64_t turnNanos = 1000000;
+
+private:
+    friend class BenchmarkTarget;
+
+    void makeCold() const;
+
+    // Counting the allocations of a batch
+    AllocationCounts startAllocations();
+    void stopAllocations( const AllocationCounts& before, std::uint64_t calls );
+
+    // Doubles the batch until it is long enough, which also warms up, but
+    // not so far that minBatches of them, with their setup, overrun the time
+    template <class Batch>
+    std::uint64_t findBatch( Batch& batch )
+    {
+        const double budget = seconds_ * 1e9 / BenchClock::nanosPerTick();
+        const double started = spentTicks_;
+        std::uint64_t n = 1;
+        for (;;) {
+            const double before = spentTicks_;
+            double ticks = batch( n, false );
+            double spent = spentTicks_ - before;
+            if (ticks*BenchClock::nanosPerTick() >= minBatchNanos ||
+                n >= (1u << 30) || spentTicks_-started >= budget ||
+                2.*spent*minBatches > budget)
+                return n;
+            n *= 2;
+        }
+    }
+
+    // Times batches of calls for the benchmark's time, where batch( n, cold )
+    // makes n calls and returns the ticks they took, not counting pauses
+    template <class Batch>
+    void runBatches( Batch batch );
+
+    // Times blocks of batches when turns_ says to, the first to warm up
+    template <class Batch>
+    void runInTurns( Batch& batch );
+
+    template <class Op>
+    double timeBatch( Op& op, std::uint64_t n )
+    {
+        const double paused = pausedTicks_;
+        const AllocationCounts before = startAllocations();
+        std::uint64_t start = BenchClock::start();
+        for (std::uint64_t i = 0; i < n; ++i)
+            callAndKeep( op );
+        std::uint64_t stop = BenchClock::stop();
+        stopAllocations( before, n );
+        calls_ += n;
+        spentTicks_ += double( stop - start );
+        return double( stop - start ) - (pausedTicks_ - paused);
+    }
+
+    template <class Op, class Input>
+    double timeBatch( Op& op, std::vector<Input>& inputs )
+    {
+        const double paused = pausedTicks_;
+        const AllocationCounts before = startAllocations();
+        std::uint64_t start = BenchClock::start();
+        for (auto& input : inputs)
+            callAndKeep( op, input );
+        std::uint64_t stop = BenchClock::stop();
+        stopAllocations( before, inputs.size() );
+        calls_ += inputs.size();
+        spentTicks_ += double( stop - start );
+        return double( stop - start ) - (pausedTicks_ - paused);
+    }
+
+    const char* baseName_;
+    std::string name_;
+    std::vector<std::size_t> sizes_;
+    std::size_t sizeIndex_ = 0;
+    std::size_t size_ = 0;
+    double seconds_;
+    bool cold_;
+    std::vector<std::pair<const void*, std::size_t>> coldInputs_;
+    std::uint64_t iterations_ = 0;
+    std::uint64_t calls_ = 0;
+    double bytes_ = 0.;
+    double items_ = 0.;
+    std::map<std::string, double> counters_;
+    Histogram samples_;
+    Histogram coldSamples_;
+    BenchmarkTurns* turns_ = nullptr;
+    int side_ = 0;
+    std::uint64_t timedCalls_ = 0;
+    std::uint64_t allocations_ = 0;
+    std::uint64_t allocatedBytes_ = 0;
+    std::uint64_t peakBytes_ = 0;
+    double spentTicks_ = 0.;        // Timed, including pauses and setup
+    double pausedTicks_ = 0.;
+    std::uint64_t pausedAt_ = 0;
+    AllocationCounts pausedCounts_ = AllocationCounts();
+    std::uint64_t pausedAllocations_ = 0;     // Since startAllocations()
+    std::uint64_t pausedBytes_ = 0;
+};
+
+template <class Op>
+void Benchmark::run( Op op )
+{
+    runBatches( [&]( std::uint64_t n, bool cold ) {
+        if (cold)
+            makeCold();
+        return timeBatch( op, n );
+    } );
+}
+
+template <class Setup, class Op>
+void Benchmark::run( Setup setup, Op op )
+{
+    std::vector<typename std::decay<decltype( setup() )>::type> inputs;
+    runBatches( [&]( std::uint64_t n, bool cold ) {
+        std::uint64_t start = BenchClock::start();
+        inputs.clear();
+        inputs.reserve( n );
+        for (std::uint64_t i = 0; i < n; ++i)
+            inputs.push_back( setup() );
+        spentTicks_ += double( BenchClock::stop() - start );
+        if (cold)
+            makeCold();
+        return timeBatch( op, inputs );
+    } );
+}
+
+template <class Batch>
+void Benchmark::runBatches( Batch batch )
+{
+    BenchClock::calibrate();
+    if (turns_) {
+        runInTurns( batch );
+        return;
+    }
+    const double overhead = BenchClock::overheadTicks();
+    const double nanosPerTick = BenchClock::nanosPerTick();
+    std::uint64_t size = findBatch( batch );
+
+    // Noisy runs are tried again, keeping the quietest
+    const double budget = seconds_ * 1e9 / nanosPerTick;
+    for (int attempt = 0; attempt <= noiseRetries; ++attempt) {
+        Histogram samples;
+        std::uint64_t iterations = 0;
+        const double started = spentTicks_;
+        while (spentTicks_-started < budget && samples.count() < maxSamples) {
+            double ticks = batch( size, false );
+            iterations += size;
+            samples.record( std::uint64_t( std::max( 0., ticks-overhead ) *
+                                           nanosPerTick * 1000. / size ) );
+        }
+        if (attempt == 0 || noiseOf( samples ) < noise()) {
+            samples_ = samples;
+            iterations_ = iterations;
+        }
+        if (!noisy())
+            break;
+    }
+
+    // Making the caches cold is not timed, but counts toward the time
+    if (cold_) {
+        typedef std::chrono::steady_clock steady;
+        auto until = steady::now() + std::chrono::duration_cast<steady::duration>(
+                                         std::chrono::duration<double>( seconds_ ) );
+        while (coldSamples_.count() < maxColdSamples &&
+               (coldSamples_.count() < minColdSamples || steady::now() < until)) {
+            double ticks = batch( 1, true );
+            coldSamples_.record( std::uint64_t( std::max( 0., ticks-overhead ) *
+                                                nanosPerTick * 1000. ) );
+        }
+    }
+}
+
+template <class Batch>
+void Benchmark::runInTurns( Batch& batch )
+{
+    const double overhead = BenchClock::overheadTicks();
+    const double nanosPerTick = BenchClock::nanosPerTick();
+    if (!turns_->await( side_ ))
+        return;
+    std::uint64_t size = findBatch( batch );
+    turns_->done( side_, 0. );
+    while (turns_->await( side_ )) {
+        double picos = 0.;
+        std::uint64_t calls = 0;
+        const double started = spentTicks_;
+        while ((spentTicks_-started) * nanosPerTick < turnNanos) {
+            double batchPicos = std::max( 0., batch( size, false )-overhead ) *
+                                nanosPerTick * 1000.;
+            picos += batchPicos;
+            calls += size;
+            samples_.record( std::uint64_t( batchPicos / size ) );
+        }
+        iterations_ += calls;
+        turns_->done( side_, picos / calls );
+    }
+}
+
+typedef void BenchmarkFunc( Benchmark& b );
+
+class BenchmarkTarget {
+public:
+    // Benchmarks from TEMPLATE_BENCHMARK have the template's name as their
+    // group, and the type they are for
+    BenchmarkTarget( BenchmarkFunc *bf, const char* bfName,
+                     const char* group = nullptr, const char* type = nullptr );
+
+    // Runs the benchmarks with names containing pattern, in order,
+    // reporting them on std::cout
+    static FailRatio runBenchmarks( const std::string& pattern );
+    // Runs the two benchmarks named in turns, on a thread each, reporting
+    // the difference in their times
+    static FailRatio compareBenchmarks( const std::string& first,
+                                        const std::string& second,
+                                        double seconds );
+
+    static const std::size_t minTurns = 20;
+    static const std::size_t maxTurns = 1000000;
+
+private:
+    BenchmarkFunc *benchfunc_;
+    BenchmarkTarget *next_;
+    const char *bfname_;
+    const char *group_;
+    const char *type_;
+
+    static BenchmarkTarget *head_;
+};
+
+// A benchmark for each of the Types, from TEMPLATE_BENCHMARK, where
+// Instances::get<T>() gives the benchmark for T
+template <class Instances, class... Types>
+class TemplateBenchmark {
+public:
+    explicit TemplateBenchmark( const char* name )
+        : names_( instanceNames( name, { &typeid( Types )... } ) )
+    {
+        BenchmarkFunc* funcs[] = { Instances::template get<Types>()... };
+        const std::type_info* types[] = { &typeid( Types )... };
+        for (std::size_t i = 0; i < names_.size(); ++i)
+            types_.push_back( typeName( *types[i] ) );
+        for (std::size_t i = 0; i < names_.size(); ++i)
+            targets_.emplace_back( new BenchmarkTarget( funcs[i], names_[i].c_str(),
+                                                        name, types_[i].c_str() ) );
+    }
+
+private:
+    std::vector<std::string> names_;
+    std::vector<std::string> types_;
+    std::vector<std::unique_ptr<BenchmarkTarget>> targets_;
+};
+
+// Runs the benchmarks with names containing pattern
+FailRatio runBenchmarks( const std::string& pattern = "" );
+
+// Times the two benchmarks named by turns, for seconds each, and reports
+// the difference in their times with its 95% confidence interval
+FailRatio compareBenchmarks( const std::string& first, const std::string& second,
+                             double seconds = options().benchmarkSeconds );
+
+// Size of the largest CPU cache, or a guess at it
+std::size_t lastLevelCacheSize();
+// Pushes everything out of the data caches, by touching a buffer larger
+// than the last level cache
+void evictCaches();
+// Flushes the lines holding size bytes at data from every cache (on x86,
+// otherwise evicts everything)
+void flushFromCaches( const void* data, std::size_t size );
+
+// What benchmark results depend on, besides the code
+struct Environment {
+    std::string cpu;            // Model name
+    std::string governor;       // Frequency scaling governor
+    std::string turbo;          // Frequency boost on or off
+    std::string smt;            // Hyperthreading on or off
+    std::string kernel;
+    std::string compiler;       // Name, version and options visible to it
+    double loadAverage = 0.;    // Over the last minute
+    unsigned cpus = 0;
+
+    // A hash of everything but the load, which differs when results do
+    std::uint64_t fingerprint() const;
+    std::string describe() const;
+};
+
+// The machine and build this is running on, found the first time
+const Environment& environment();
+
+// Confines the calling thread to the given CPU, or to an isolated one if
+// cpu is -2, until destroyed. Only on Linux.
+class PinToCpu {
+public:
+    explicit PinToCpu( int cpu );
+    ~PinToCpu();
+    PinToCpu( const PinToCpu& ) = delete;
+    PinToCpu& operator=( const PinToCpu& ) = delete;
+    int cpu() const { return cpu_; }    // -1 if not pinned
+private:
+    int cpu_ = -1;
+#if defined(__linux__)
+    cpu_set_t saved_;
+#endif
+};
+
+
+#ifdef SELFTEST_IMPLEMENTATION
+
+const bool clock::is_steady;
+std::atomic<clock::rep> clock::now_( 0 );
+std::atomic<clock::rep> clock::step_( 0 );
+thread_local clock::rep clock::advanced_ = 0;
+
+clock::time_point clock::now() noexcept
+{
+    return time_point( duration( now_.fetch_add( step_ ) ) );
+}
+
+clock::time_point clock::peek() noexcept
+{
+    return time_point( duration( now_.load() ) );
+}
+
+clock::duration clock::advancedByThisThread() noexcept
+{
+    return duration( advanced_ );
+}
+
+void clock::advance( duration d ) noexcept
+{
+    if (d.count() > 0) {
+        now_ += d.count();
+        advanced_ += d.count();
+    }
+}
+
+void clock::autoAdvance( duration step ) noexcept
+{
+    step_ = step.count() > 0 ? step.count() : 0;
+}
+
+void clock::sleep_until( time_point tp ) noexcept
+{
+    // Only ever move forward, even if another thread got there first
+    rep target = tp.time_since_epoch().count();
+    rep current = now_.load();
+    while (current < target && !now_.compare_exchange_weak( current, target ))
+        ;
+    if (current < target)
+        advanced_ += target - current;
+}
+
+
+void note( const char* message, const char* fileName, int lineNum )
+{
+    reportStream( std::clog ) << fileName << ":" << lineNum << ":0: note: "
+                              << message << std::endl;
+}
+
+
+std::string describeNear( double a, double b, double absTol, double relTol )
+{
+    std::ostringstream os;
+    os.precision( 17 );
+    os << "\n" << a << " and\n" << b << " differ by " << std::fabs( a-b )
+       << ", more than " << nearTolerance( a, b, absTol, relTol );
+    return os.str();
+}
+
+std::string describeUlp( double a, double b, std::uint64_t ulps,
+                         std::uint64_t maxUlps )
+{
+    std::ostringstream os;
+    os.precision( 17 );
+    os << "\n" << a << " and\n" << b << " are " << ulps
+       << " ulps apart, more than " << maxUlps;
+    return os.str();
+}
+
+const int FloatCheckResult::numBuckets;
+
+FloatCheckResult::FloatCheckResult( std::uint64_t n )
+    : numFailed( 0 ),
+      numChecked( n ),
+      worstIndex( 0 ),
+      worstA( 0. ),
+      worstB( 0. ),
+      worstError( -1. )
+{
+    std::fill( histogram, histogram+numBuckets, 0 );
+}
+
+void FloatCheckResult::record( std::size_t i, double a, double b,
+                               double error, int bucket )
+{
+    ++histogram[bucket];
+    if (bucket)
+        ++numFailed;
+    if (error > worstError) {
+        worstIndex = i;
+        worstA = a;
+        worstB = b;
+        worstError = error;
+    }
+}
+
+std::string FloatCheckResult::describe( const char* errorName ) const
+{
+    std::ostringstream os;
+    os.precision( 17 );
+    os << ": " << numFailed << " of " << numChecked << " elements failed,"
+       << " worst at index " << worstIndex << ": " << worstA << " and "
+       << worstB << " (" << errorName << " " << worstError << ")"
+       << "\n    histogram:";
+    for (int k = 0; k < numBuckets; ++k) {
+        if (!histogram[k])
+            continue;
+        os << "\n    ";
+        if (k == 0)
+            os << "within tolerance";
+        else if (k == numBuckets-1)
+            os << "infinite or NaN";
+        else
+            os << "up to 2^" << k;
+        os << ": " << histogram[k];
+    }
+    return os.str();
+}
+
+bool& QuietFailures::quiet()
+{
+    static thread_local bool quiet = false;
+    return quiet;
+}
+
+std::ostream*& CaptureReports::capture()
+{
+    static thread_local std::ostream* capture = nullptr;
+    return capture;
+}
+
+std::ostream& reportStream( std::ostream& usual )
+{
+    std::ostream* captured = CaptureReports::capture();
+    return captured ? *captured : usual;
+}
+
+std::uint64_t testSeed( const char* name )
+{
+    // FNV-1a
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    for (; *name; ++name)
+        hash = (hash ^ std::uint8_t( *name )) * 0x100000001b3ull;
+    if (options().shuffle)
+        hash ^= Rng( options().shuffleSeed ).next();
+    return hash;
+}
+
+Rng& testRng()
+{
+    static thread_local Rng rng( 0 );
+    return rng;
+}
+
+unsigned workerCount()
+{
+    static const unsigned count = std::max( 1u,
+                                    std::thread::hardware_concurrency() );
+    return count;
+}
+
+
+#ifdef TRACETHROWS
+// Set while a throw is being recorded, so that it is recorded once
+static thread_local bool tracingThrow = false;
+
+static void reportThrowsAtExit()
+{
+    ThrowTracer::global().report( std::cerr );
+}
+
+// The tracer is constructed before the report is registered, so that it is
+// destroyed after the report is written
+static ThrowTracer& reportedTracer()
+{
+    static ThrowTracer& tracer = ThrowTracer::global();
+    static bool registered = (std::atexit( reportThrowsAtExit ), true);
+    (void)registered;
+    return tracer;
+}
+
+static void traceThrower( failType ft, const char* function,
+                          const char* fileName, int lineNum )
+{
+    tracingThrow = true;
+    reportedTracer().recordThrower( ft, function, fileName, lineNum );
+}
+#endif
+
+void thrower(
+    const failType ft,
+    const char* failedPredicate,
+    const char* function,
+    const char* fileName,
+    int lineNum )
+{    
+    /* Compose message texts:
+    <file>:<line>:0: error: <ft text> '<failedPredicate>' failed in <function>.
+    */
+#ifdef TRACETHROWS
+    traceThrower( ft, function, fileName, lineNum );
+#endif
+
+    std::string message;
+    if (fileName && lineNum) {
+        message = std::string(fileName) + ":" + 
+                std::to_string(lineNum) + ":0: error: ";
+    }
+    switch (ft) {
+    case failType::badarg:
+        message += "Argument test";
+        break;
+    case failType::badassert:
+        message += "Assertion";
+        break;
+    case failType::badselftest:
+        message += "Self test";
+        break;
+    case failType::badunittest:
+        message += "Unit test";
+        break;
+    case failType::overlimit:
+        message += "Reasonable limit";
+        break;
+    }
+
+    if (failedPredicate)
+        message += std::string(" '") + failedPredicate + "'";
+    message += " failed";
+    if (function)
+        message += std::string(" in ") + function;
+    message += '.';
+
+#ifdef STACKTRACES
+    // Only the addresses now, not this function's
+    StackTrace stack;
+    stack.numFrames = captureStack( stack.frames, StackTrace::maxFrames, 1 );
+
+    switch (ft) {
+    case failType::badarg:
+        throw WithStackTrace<std::invalid_argument>(message, stack);
+        break;
+    case failType::badassert:
+        throw WithStackTrace<selftest::selftest_error>(message, stack);
+        break;
+    case failType::badselftest:
+        throw WithStackTrace<selftest::selftest_error>(message, stack);
+        break;
+    case failType::badunittest:
+        if (!QuietFailures::quiet())
+            std::cerr << message << '\n' << stack.describe() << std::flush;
+        if (TestContext::recordFailure())
+            return;
+        throw terminate_unittest();
+        break;
+    case failType::overlimit:
+        throw WithStackTrace<selftest::over_reasonable_limit>(message, stack);
+        break;
+    }
+#else
+    switch (ft) {
+    case failType::badarg:
+        throw std::invalid_argument(message);
+        break;
+    case failType::badassert:
+        throw selftest::selftest_error(message);
+        break;
+    case failType::badselftest:
+        throw selftest::selftest_error(message);
+        break;
+    case failType::badunittest:
+        if (!QuietFailures::quiet())
+            std::cerr << message << std::endl;
+        if (TestContext::recordFailure())
+            return;
+        throw terminate_unittest();
+        break;
+    case failType::overlimit:
+        throw selftest::over_reasonable_limit(message);
+        break;
+    }
+#endif
+
+    return;
+}
+
+
+Suite& defaultSuite()
+{
+    static Suite suite( "", Concurrency::serial );
+    return suite;
+}
+
+UnitTest::UnitTest( TestFunc *tf, const char* tfName, Suite& suite )
+    : testfunc_( tf ),
+      tfname_( tfName ),
+      suite_( &suite )
+{
+    static UnitTest *head = nullptr;
+    next_ = head;
+    if (tf)
+        head = this;
+    else
+        head = nullptr;			// Last test registered, reset list
+}
+
+thread_local TestContext* TestContext::current_ = nullptr;
+thread_local bool TestContext::records_ = false;
+
+void TestContext::fail( std::exception_ptr failure )
+{
+    std::lock_guard<std::mutex> guard( lock_ );
+    if (!first_)
+        first_ = failure;
+    failed_ = true;
+}
+
+std::exception_ptr TestContext::firstFailure() const
+{
+    std::lock_guard<std::mutex> guard( lock_ );
+    return first_;
+}
+
+bool TestContext::recordFailure()
+{
+    // Quiet checks are probing for failures, which must throw
+    if (!current_ || !records_ || QuietFailures::quiet())
+        return false;
+    current_->fail( std::make_exception_ptr( terminate_unittest() ) );
+    return true;
+}
+
+// Writes what failed a unit test, unless it has been written already
+static void reportFailure( std::exception_ptr failure, const char* tfName )
+{
+    try {
+        std::rethrow_exception( failure );
+    }
+
+    catch( const terminate_unittest& e ) {
+        // Message, already written
+    }
+
+    catch( const char* e ) {
+        std::cerr << "Exception thrown during unit test '" << tfName
+             <<  "': \"" << e << "\"." << std::endl;
+    }
+
+    catch( const std::exception& e ) {
+        std::cerr << "Exception thrown during unit test '" << tfName
+             << "': " << e.what() << "." << std::endl;
+    }
+
+    catch( ... ) {
+        std::cerr << "Exception of unknown type thrown during unit test '"
+             << tfName << "'." << std::endl;
+    }
+}
+
+bool UnitTest::callUnitTest()
+{
+    testRng() = Rng( testSeed( tfname_ ) );
+    return callTest( testfunc_, tfname_, true );
+}
+
+bool UnitTest::callTest( TestFunc *tf, const char* tfName, bool timeLimited )
+{
+    // Maximum duration for a single unit test
+    const int time_limit_seconds = 2;
+    bool failedTest = false;
+    TestContext context( tfName );
+    TestContext::Scope scope( &context, false );
+
+    try {
+        auto testStart = std::chrono::high_resolution_clock::now();
+        auto virtualStart = clock::advancedByThisThread();
+
+        tf();
+        // Failures of other threads working for the test
+        if (context.failed())
+            std::rethrow_exception( context.firstFailure() );
+
+        // Time this thread spent sleeping in virtual time counts too, but
+        // not sleeps of tests running beside it
+        auto duration = std::chrono::duration_cast<clock::duration>(
+                std::chrono::high_resolution_clock::now()-testStart ) +
+                ( clock::advancedByThisThread()-virtualStart );
+        if ( timeLimited && duration > std::chrono::seconds(time_limit_seconds) ) {
+            std::cerr << "Unit test " << tfName << " not complete within "
+                 << time_limit_seconds << " seconds." << std::endl;
+            failedTest = true;
+        }
+        return failedTest;
+    }
+
+    catch( ... ) {
+        reportFailure( std::current_exception(), tfName );
+    }
+
+    failedTest = true;
+    return failedTest;
+}
 
 FailRatio UnitTest::runUnitTestsImpl()
 {
-    bool failedTest = false;
-    UnitTest lastTest( nullptr, "Tests complete" );
-    // Reverse list so that they are run in the order given
-    UnitTest *newHead = nullptr;
-    UnitTest *oldHead = lastTest.next_;
-    UnitTest *tptr = nullptr;
+    UnitTest lastTest( nullptr, "Tests complete" );
+    // Reverse list so that they are run in the order given
+    UnitTest *newHead = nullptr;
+    UnitTest *oldHead = lastTest.next_;
+    UnitTest *tptr = nullptr;
+
+    while (oldHead) {
+        // Unlink from old
+        tptr = oldHead;
+        oldHead = oldHead->next_;
+        // Link to end of new
+        tptr->next_ = newHead;
+        newHead = tptr;
+    }
+
+    std::vector<UnitTest*> tests;
+    for (tptr = newHead; tptr; tptr = tptr->next_)
+        tests.push_back( tptr );
+
+    if (options().shuffle) {
+        if (!options().shuffleSeedGiven) {
+            std::random_device entropy;
+            options().shuffleSeed = (std::uint64_t( entropy() ) << 32 |
+                    entropy()) ^ std::uint64_t( std::chrono::
+                    high_resolution_clock::now().time_since_epoch().count() );
+            options().shuffleSeedGiven = true;
+        }
+        std::cerr << "Unit tests shuffled, repeat with --shuffle="
+                  << options().shuffleSeed << std::endl;
+        // Fisher-Yates with our own Rng gives the same order everywhere
+        Rng rng( options().shuffleSeed );
+        for (std::size_t i = tests.size(); i > 1; --i)
+            std::swap( tests[i-1], tests[rng.below( i )] );
+    }
+
+    // --repeat runs the whole sequence again, timing each test every time
+    const std::size_t numDistinct = tests.size();
+    for (unsigned r = 1; r < options().repeat; ++r)
+        tests.insert( tests.end(), tests.begin(), tests.begin() + numDistinct );
+    std::map<const UnitTest*, Histogram> durations;
+
+    // Scheduling state, all guarded by lock
+    struct SuiteState {
+        std::size_t remaining = 0;      // Tests not yet finished
+        int running = 0;
+        bool settingUp = false;
+        bool setUp = false;
+        bool setupFailed = false;
+    };
+    std::map<const Suite*, SuiteState> suites;
+    for (auto t : tests)
+        ++suites[t->suite_].remaining;
+    std::set<std::string> resourcesHeld;
+    std::vector<bool> started( tests.size(), false );
+    std::size_t firstUnstarted = 0;
+    int running = 0;
+    bool exclusiveRunning = false;
+    std::mutex lock;
+    std::condition_variable changed;
+
+    auto runnable = [&]( const UnitTest* t ) {
+        const Suite* s = t->suite_;
+        const SuiteState& ss = suites[s];
+        if (exclusiveRunning || ss.settingUp)
+            return false;
+        if (s->concurrency_ == Concurrency::exclusive && running)
+            return false;
+        if (s->concurrency_ != Concurrency::parallel && ss.running)
+            return false;
+        for (auto& r : s->resources_) {
+            if (resourcesHeld.count( r ))
+                return false;
+        }
+        return true;
+    };
+
+    // Now call them. Each worker takes the first test that may run beside
+    // those already running, so with one worker they run in order.
+    FailRatio rc {0,0};
+    auto worker = [&] {
+        std::unique_lock<std::mutex> guard( lock );
+        for (;;) {
+            while (firstUnstarted < tests.size() && started[firstUnstarted])
+                ++firstUnstarted;
+            if (firstUnstarted == tests.size())
+                return;
+            std::size_t pick = firstUnstarted;
+            while (pick < tests.size() &&
+                   (started[pick] || !runnable( tests[pick] )))
+                ++pick;
+            if (pick == tests.size()) {
+                changed.wait( guard );
+                continue;
+            }
+
+            UnitTest *t = tests[pick];
+            const Suite *s = t->suite_;
+            SuiteState& ss = suites[s];
+            started[pick] = true;
+            ++running;
+            ++ss.running;
+            if (s->concurrency_ == Concurrency::exclusive)
+                exclusiveRunning = true;
+            for (auto& r : s->resources_)
+                resourcesHeld.insert( r );
+            bool runSetup = !ss.setUp;
+            ss.settingUp = runSetup;
+            guard.unlock();
+
+            bool failedTest = false;
+            if (runSetup) {
+                if (s->setup_)
+                    failedTest = callTest( s->setup_,
+                            (std::string( s->name_ ) + " setup").c_str(), false );
+                guard.lock();
+                ss.setUp = true;
+                ss.settingUp = false;
+                ss.setupFailed = failedTest;
+                changed.notify_all();
+                guard.unlock();
+            }
+            if (ss.setupFailed) {
+                std::cerr << "Unit test " << t->tfname_ << " not run, setup of "
+                          << s->name_ << " failed." << std::endl;
+                failedTest = true;
+            } else {
+                auto start = std::chrono::steady_clock::now();
+                failedTest = t->callUnitTest();
+                if (options().repeat > 1) {
+                    auto nanos = std::chrono::duration_cast<std::chrono::
+                            nanoseconds>( std::chrono::steady_clock::now() - start );
+                    guard.lock();
+                    durations[t].record( std::uint64_t( nanos.count() ) );
+                    guard.unlock();
+                }
+            }
+
+            guard.lock();
+            if (--ss.remaining == 0 && s->teardown_ && !ss.setupFailed) {
+                // The last test of the suite keeps its place until teardown
+                guard.unlock();
+                if (callTest( s->teardown_,
+                        (std::string( s->name_ ) + " teardown").c_str(), false ))
+                    failedTest = true;
+                guard.lock();
+            }
+            ++rc.numTests;
+            if (failedTest) {
+                ++rc.numFailedTests;
+            }
+            --running;
+            --ss.running;
+            if (s->concurrency_ == Concurrency::exclusive)
+                exclusiveRunning = false;
+            for (auto& r : s->resources_)
+                resourcesHeld.erase( r );
+            changed.notify_all();
+        }
+    };
+
+    unsigned jobs = options().jobs ? options().jobs : workerCount();
+    std::vector<std::thread> threads;
+    for (unsigned j = 1; j < jobs; ++j)
+        threads.emplace_back( worker );
+    worker();
+    for (auto& th : threads)
+        th.join();
+
+    if (options().repeat > 1) {
+        for (std::size_t i = 0; i < numDistinct; ++i) {
+            auto d = durations.find( tests[i] );
+            if (d != durations.end())
+                std::clog << std::left << std::setw( 32 ) << tests[i]->tfname_
+                          << std::right << " " << describePercentiles( d->second, 1. )
+                          << " of " << d->second.count() << " runs" << std::endl;
+        }
+    }
+
+#if defined(__cpp_impl_coroutine)
+    FailRatio async = AsyncTest::runAsyncTests( jobs );
+    rc.numTests += async.numTests;
+    rc.numFailedTests += async.numFailedTests;
+#endif
+    return rc;
+}
+
+#if defined(__cpp_impl_coroutine)
+
+thread_local EventLoop* EventLoop::current_ = nullptr;
+
+void EventLoop::post( std::coroutine_handle<> h )
+{
+    std::lock_guard<std::mutex> guard( lock_ );
+    ready_.push_back( Item{ h, TestContext::current() } );
+    changed_.notify_one();
+}
+
+void EventLoop::postAt( clock::time_point when, std::coroutine_handle<> h )
+{
+    std::lock_guard<std::mutex> guard( lock_ );
+    timers_.push_back( Timer{ when, numTimers_++, Item{ h, TestContext::current() } } );
+    std::push_heap( timers_.begin(), timers_.end(), std::greater<Timer>() );
+}
+
+void EventLoop::postWhen( std::function<bool()> ready, std::coroutine_handle<> h )
+{
+    std::lock_guard<std::mutex> guard( lock_ );
+    polls_.push_back( Poll{ std::move( ready ), Item{ h, TestContext::current() } } );
+}
+
+EventLoop& EventLoop::running()
+{
+    if (!current_)
+        thrower( failType::badarg, "co_await of selftest timer or future "
+                 "outside of TEST_ASYNC", __func__, __FILE__, __LINE__ );
+    return *current_;
+}
+
+void EventLoop::run( unsigned numThreads )
+{
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < numThreads; ++t)
+        threads.emplace_back( &EventLoop::work, this );
+    work();
+    for (auto& t : threads)
+        t.join();
+}
+
+// With lock_ held
+void EventLoop::moveDueTimers()
+{
+    while (!timers_.empty() && timers_.front().when <= clock::peek()) {
+        std::pop_heap( timers_.begin(), timers_.end(), std::greater<Timer>() );
+        ready_.push_back( timers_.back().item );
+        timers_.pop_back();
+    }
+}
+
+void EventLoop::work()
+{
+    EventLoop* saved = current_;
+    current_ = this;
+    std::unique_lock<std::mutex> guard( lock_ );
+    for (;;) {
+        moveDueTimers();
+        if (!ready_.empty()) {
+            Item item = ready_.front();
+            ready_.pop_front();
+            ++running_;
+            guard.unlock();
+            {
+                TestContext::Scope scope( item.context, false );
+                item.handle.resume();
+            }
+            guard.lock();
+            --running_;
+            changed_.notify_all();
+            continue;
+        }
+        if (running_) {
+            // What is running may post more
+            changed_.wait( guard );
+            continue;
+        }
+
+        // Nothing can run. Waits on other threads go first, as they may
+        // finish in less than the virtual time to the next timer.
+        bool anyReady = false;
+        for (auto p = polls_.begin(); p != polls_.end(); ) {
+            if (p->ready()) {
+                ready_.push_back( p->item );
+                p = polls_.erase( p );
+                anyReady = true;
+            } else {
+                ++p;
+            }
+        }
+        if (anyReady)
+            continue;
+        if (!timers_.empty()) {
+            clock::time_point now = clock::peek();
+            if (timers_.front().when > now)
+                clock::advance( timers_.front().when - now );
+            continue;
+        }
+        if (!polls_.empty()) {
+            changed_.wait_for( guard, std::chrono::microseconds( 100 ) );
+            continue;
+        }
+        break;
+    }
+    changed_.notify_all();
+    current_ = saved;
+}
+
+AsyncTest *AsyncTest::head_ = nullptr;
+
+AsyncTest::AsyncTest( AsyncTestFunc *atf, const char* atfName )
+    : asyncfunc_( atf ), next_( head_ ), atfname_( atfName )
+{
+    head_ = this;
+}
+
+// Coroutine that runs an async test, and is destroyed when it finishes
+struct AsyncRun {
+    struct promise_type {
+        AsyncRun get_return_object()
+        {
+            return AsyncRun{ std::coroutine_handle<promise_type>::from_promise( *this ) };
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+static AsyncRun runAsyncTest( AsyncTestFunc *atf, const char* atfName,
+                              TestContext& context,
+                              std::atomic<int>& numFailed )
+{
+    bool failedTest = false;
+    try {
+        co_await atf();
+        // Failures of other threads working for the test
+        if (context.failed())
+            std::rethrow_exception( context.firstFailure() );
+    }
+    catch( ... ) {
+        reportFailure( std::current_exception(), atfName );
+        failedTest = true;
+    }
+    if (failedTest)
+        ++numFailed;
+}
+
+FailRatio AsyncTest::runAsyncTests( unsigned numThreads )
+{
+    std::vector<AsyncTest*> tests;
+    for (AsyncTest* t = head_; t; t = t->next_)
+        tests.push_back( t );
+    // In the order given
+    std::reverse( tests.begin(), tests.end() );
+
+    EventLoop loop;
+    std::vector<std::unique_ptr<TestContext>> contexts;
+    std::atomic<int> numFailed( 0 );
+    for (auto t : tests) {
+        contexts.emplace_back( new TestContext( t->atfname_ ) );
+        TestContext::Scope scope( contexts.back().get(), false );
+        loop.post( runAsyncTest( t->asyncfunc_, t->atfname_, *contexts.back(),
+                                 numFailed ).handle );
+    }
+    loop.run( numThreads );
+
+    FailRatio rc { numFailed, int( tests.size() ) };
+    return rc;
+}
+
+#endif      // __cpp_impl_coroutine
+
+FailRatio runUnitTests()
+{
+    return UnitTest::runUnitTestsImpl();
+}
+
+FailRatio runUnitTests( int argc, char* argv[] )
+{
+    // Options not recognized here are left for the program
+    for (int i = 1; i < argc; ++i) {
+        std::string arg( argv[i] );
+        if (arg == "--update-golden")
+            options().updateGolden = true;
+        else if (arg == "--verbose")
+            options().verbose = true;
+        else if (arg.compare( 0, 7, "--jobs=" ) == 0)
+            options().jobs = unsigned( std::strtoul( arg.c_str()+7, nullptr, 10 ) );
+        else if (arg == "--shuffle")
+            options().shuffle = true;
+        else if (arg.compare( 0, 10, "--shuffle=" ) == 0) {
+            options().shuffle = true;
+            options().shuffleSeed = std::strtoull( arg.c_str()+10, nullptr, 0 );
+            options().shuffleSeedGiven = true;
+        }
+        else if (arg.compare( 0, 16, "--fixture-cache=" ) == 0)
+            options().fixtureCache = arg.substr( 16 );
+        else if (arg == "--benchmark")
+            options().benchmark = true;
+        else if (arg.compare( 0, 12, "--benchmark=" ) == 0) {
+            options().benchmark = true;
+            options().benchmarkPattern = arg.substr( 12 );
+        }
+        else if (arg.compare( 0, 17, "--benchmark-time=" ) == 0)
+            options().benchmarkSeconds = std::strtod( arg.c_str()+17, nullptr );
+        else if (arg.compare( 0, 11, "--baseline=" ) == 0)
+            options().baseline = arg.substr( 11 );
+        else if (arg.compare( 0, 16, "--save-baseline=" ) == 0)
+            options().saveBaseline = arg.substr( 16 );
+        else if (arg == "--cold-cache")
+            options().coldCache = true;
+        else if (arg.compare( 0, 18, "--benchmark-noise=" ) == 0)
+            options().benchmarkNoise = std::strtod( arg.c_str()+18, nullptr );
+        else if (arg == "--pin-cpu")
+            options().pinCpu = -2;
+        else if (arg.compare( 0, 10, "--pin-cpu=" ) == 0)
+            options().pinCpu = int( std::strtol( arg.c_str()+10, nullptr, 10 ) );
+        else if (arg.compare( 0, 10, "--compare=" ) == 0)
+            options().compare = arg.substr( 10 );
+        else if (arg.compare( 0, 9, "--repeat=" ) == 0)
+            options().repeat = std::max( 1ul, std::strtoul( arg.c_str()+9, nullptr, 10 ) );
+    }
+    FailRatio rc = UnitTest::runUnitTestsImpl();
+    if (options().benchmark) {
+        FailRatio benchmarks = runBenchmarks( options().benchmarkPattern );
+        rc.numTests += benchmarks.numTests;
+        rc.numFailedTests += benchmarks.numFailedTests;
+    }
+    if (!options().compare.empty()) {
+        std::string::size_type comma = options().compare.find( ',' );
+        FailRatio compared = compareBenchmarks( options().compare.substr( 0, comma ),
+                                                comma == std::string::npos ? ""
+                                                    : options().compare.substr( comma+1 ) );
+        rc.numTests += compared.numTests;
+        rc.numFailedTests += compared.numFailedTests;
+    }
+    return rc;
+}
+
+int captureStack( void** frames, int maxFrames, int skip )
+{
+#if defined(__GLIBC__) || defined(__APPLE__)
+    void* all[64];
+    ++skip;     // and this one
+    int n = backtrace( all, std::min( maxFrames+skip, 64 ) ) - skip;
+    if (n <= 0)
+        return 0;
+    std::copy( all+skip, all+skip+n, frames );
+    return n;
+#else
+    (void)frames;
+    (void)maxFrames;
+    (void)skip;
+    return 0;
+#endif
+}
+
+static std::string demangle( const char* name )
+{
+#if defined(__GNUC__)
+    int status = 0;
+    char* plain = abi::__cxa_demangle( name, nullptr, nullptr, &status );
+    if (plain) {
+        std::string result( plain );
+        std::free( plain );
+        return result;
+    }
+#endif
+    return name;
+}
+
+// The arguments before at of the template argument list that at is in
+static std::vector<std::string> argumentsBefore( const std::string& name,
+                                                 std::string::size_type at )
+{
+    std::vector<std::string> args;
+    std::string::size_type end = at;
+    int depth = 0;
+    for (std::string::size_type i = at; i-- > 0;) {
+        char c = name[i];
+        if (c == '>') {
+            ++depth;
+        } else if (c == '<' && depth > 0) {
+            --depth;
+        } else if ((c == '<' || c == ',') && depth == 0) {
+            std::string arg = name.substr( i+1, end-i-1 );
+            arg.erase( 0, arg.find_first_not_of( ' ' ) );
+            arg.erase( arg.find_last_not_of( ' ' )+1 );
+            args.insert( args.begin(), arg );
+            end = i;
+            if (c == '<')
+                break;
+        }
+    }
+    return args;
+}
+
+// Without the standard library's default template arguments and inline
+// namespaces, as types are written. An argument is left in unless it is the
+// default, so std::set<int, std::less<void>> keeps its comparison.
+std::string typeName( const std::type_info& type )
+{
+    std::string name = demangle( type.name() );
+    for (const char* inner : { "std::__cxx11::", "std::__1::" }) {
+        std::string::size_type at;
+        while ((at = name.find( inner )) != std::string::npos)
+            name.erase( at+5, std::strlen( inner )-5 );
+    }
+    std::string::size_type at;
+    while ((at = name.find( "> >" )) != std::string::npos)
+        name.erase( at+1, 1 );
+    // Again until nothing changes, as an argument's own arguments must go
+    // before it can be seen to be the default
+    for (std::string last; last != name;) {
+        last = name;
+        for (const char* defaulted : { ", std::allocator<", ", std::char_traits<",
+                                       ", std::less<", ", std::hash<",
+                                       ", std::equal_to<" }) {
+            std::string::size_type from = 0;
+            while ((at = name.find( defaulted, from )) != std::string::npos) {
+                std::string::size_type open = at + std::strlen( defaulted );
+                std::string::size_type end = open;
+                for (int depth = 1; end < name.size() && depth; ++end)
+                    depth += name[end] == '<' ? 1 : name[end] == '>' ? -1 : 0;
+                std::string arg = name.substr( open, end-1-open );
+                arg.erase( arg.find_last_not_of( ' ' )+1 );
+                // The default is of the first argument, or for the allocator
+                // of a map, of its pairs
+                std::vector<std::string> args = argumentsBefore( name, at );
+                bool isAllocator = std::strcmp( defaulted, ", std::allocator<" ) == 0;
+                bool isDefault = !args.empty() && (arg == args[0] ||
+                        (isAllocator && args.size() >= 2 &&
+                         arg == "std::pair<" + args[0] + " const, " + args[1] + ">"));
+                if (!isDefault) {
+                    from = open;
+                    continue;
+                }
+                name.erase( at, end-at );
+                if (name.compare( at, 2, " >" ) == 0)
+                    name.erase( at, 1 );
+                from = at;
+            }
+        }
+    }
+    while ((at = name.find( "std::basic_string<char>" )) != std::string::npos)
+        name.replace( at, 23, "std::string" );
+    return name;
+}
+
+std::vector<std::string> instanceNames( const char* name,
+    std::initializer_list<const std::type_info*> types )
+{
+    std::vector<std::string> names;
+    for (auto type : types)
+        names.push_back( std::string( name ) + "<" + typeName( *type ) + ">" );
+    return names;
+}
+
+static void describeFrame( std::ostream& os, const void* frame )
+{
+    os << frame;
+#if defined(__GLIBC__) || defined(__APPLE__)
+    Dl_info info;
+    if (!dladdr( frame, &info ))
+        return;
+    if (info.dli_sname) {
+        os << " " << demangle( info.dli_sname ) << "+0x" << std::hex
+           << (static_cast<const char*>( frame ) -
+               static_cast<const char*>( info.dli_saddr )) << std::dec;
+    }
+    if (info.dli_fname)
+        os << " (" << info.dli_fname << ")";
+#endif
+}
+
+std::string describeStack( void* const* frames, int numFrames )
+{
+    std::ostringstream os;
+    for (int i = 0; i < numFrames; ++i) {
+        os << "    #" << i << " ";
+        describeFrame( os, frames[i] );
+        os << "\n";
+    }
+    return os.str();
+}
+
+const int ThrowTracer::maxFrames;
+const int StackTrace::maxFrames;
+
+ThrowTracer::Site& ThrowTracer::site( const Key& key )
+{
+    Site& s = sites_[key];
+    // Sample a stack on the 1st, 2nd, 4th, 8th... throw from a site, so
+    // frequent throwers pay for very few
+    ++s.count;
+    if (s.count & (s.count-1))
+        return s;
+    // Not this, record...() or its caller, traceThrower() or __cxa_throw()
+    s.numFrames = captureStack( s.frames, maxFrames, 3 );
+    return s;
+}
+
+static const char* throwerTypeName( failType ft )
+{
+    switch (ft) {
+    case failType::badarg:      return "std::invalid_argument (BAD_ARG)";
+    case failType::badassert:   return "selftest::selftest_error (ASSERT)";
+    case failType::badselftest: return "selftest::selftest_error (TEST_FAIL)";
+    case failType::badunittest: return "selftest::terminate_unittest (CHECK)";
+    case failType::overlimit:   return "selftest::over_reasonable_limit";
+    }
+    return "?";
+}
+
+void ThrowTracer::recordThrower( failType ft, const char* function,
+                                 const char* fileName, int lineNum )
+{
+    const char* typeName = throwerTypeName( ft );
+    Key key = { typeName, fileName ? static_cast<const void*>( fileName )
+                                   : static_cast<const void*>( function ),
+                lineNum };
+    std::lock_guard<std::mutex> guard( lock_ );
+    Site& s = site( key );
+    s.typeName = typeName;
+    s.function = function;
+    s.fileName = fileName;
+    s.lineNum = lineNum;
+}
+
+void ThrowTracer::recordThrow( const std::type_info& type, const void* address )
+{
+    Key key = { &type, address, 0 };
+    std::lock_guard<std::mutex> guard( lock_ );
+    Site& s = site( key );
+    s.type = &type;
+    s.address = address;
+}
+
+std::uint64_t ThrowTracer::numThrows() const
+{
+    std::lock_guard<std::mutex> guard( lock_ );
+    std::uint64_t n = 0;
+    for (auto& ks : sites_)
+        n += ks.second.count;
+    return n;
+}
+
+void ThrowTracer::report( std::ostream& os, std::size_t maxSites ) const
+{
+    std::lock_guard<std::mutex> guard( lock_ );
+    std::vector<const Site*> ranked;
+    std::uint64_t total = 0;
+    for (auto& ks : sites_) {
+        ranked.push_back( &ks.second );
+        total += ks.second.count;
+    }
+    std::stable_sort( ranked.begin(), ranked.end(),
+            []( const Site* l, const Site* r ) { return l->count > r->count; } );
+
+    os << total << " exceptions thrown from " << ranked.size() << " sites\n";
+    for (std::size_t i = 0; i < ranked.size() && i < maxSites; ++i) {
+        const Site& s = *ranked[i];
+        os << std::setw( 10 ) << s.count << "  "
+           << (s.typeName ? std::string( s.typeName ) : demangle( s.type->name() ))
+           << "\n            ";
+        if (s.fileName)
+            os << s.fileName << ":" << s.lineNum;
+        if (s.function)
+            os << " in " << s.function;
+        if (s.address)
+            describeFrame( os, s.address );
+        os << "\n";
+        if (i < 3 && s.numFrames)
+            os << describeStack( s.frames, s.numFrames );
+    }
+}
+
+ThrowTracer& ThrowTracer::global()
+{
+    static ThrowTracer tracer;
+    return tracer;
+}
+
+
+
+Options& options()
+{
+    static Options opts = [] {
+        Options o;
+        if (const char* dir = std::getenv( "SELFTEST_FIXTURE_CACHE" ))
+            o.fixtureCache = dir;
+        return o;
+    }();
+    return opts;
+}
+
+
+std::size_t firstMismatch( const unsigned char* a, const unsigned char* b,
+                           std::size_t size )
+{
+    // memcmp() is the fastest way to find a block that differs, then
+    // compare a word at a time to find the word
+    const std::size_t block = 64*1024;
+    std::size_t offset = 0;
+    while (offset < size) {
+        std::size_t n = std::min( block, size-offset );
+        if (std::memcmp( a+offset, b+offset, n ) != 0)
+            break;
+        offset += n;
+    }
+    for (; offset+8 <= size; offset += 8) {
+        std::uint64_t wa, wb;
+        std::memcpy( &wa, a+offset, 8 );
+        std::memcpy( &wb, b+offset, 8 );
+        if (wa != wb)
+            break;
+    }
+    while (offset < size && a[offset] == b[offset])
+        ++offset;
+    return offset;
+}
+
+// A read only view of a whole file, mapped into memory where possible
+class MappedFile {
+public:
+    explicit MappedFile( const std::string& path )
+        : data_( nullptr ), size_( 0 ), ok_( false )
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = open( path.c_str(), O_RDONLY );
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat( fd, &st ) == 0) {
+            size_ = std::size_t( st.st_size );
+            ok_ = true;
+            if (size_) {
+                void* p = mmap( nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+                if (p != MAP_FAILED) {
+                    madvise( p, size_, MADV_SEQUENTIAL );
+                    data_ = static_cast<const unsigned char*>( p );
+                } else {
+                    ok_ = false;
+                }
+            }
+        }
+        close( fd );
+#else
+        std::ifstream in( path.c_str(), std::ios::binary );
+        if (in) {
+            copy_.assign( std::istreambuf_iterator<char>( in ),
+                          std::istreambuf_iterator<char>() );
+            data_ = reinterpret_cast<const unsigned char*>( copy_.data() );
+            size_ = copy_.size();
+            ok_ = true;
+        }
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (data_)
+            munmap( const_cast<unsigned char*>( data_ ), size_ );
+#endif
+    }
+
+    MappedFile( const MappedFile& ) = delete;
+    MappedFile& operator=( const MappedFile& ) = delete;
+
+    bool ok() const { return ok_; }
+    const unsigned char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+private:
+    const unsigned char* data_;
+    std::size_t size_;
+    bool ok_;
+#if !defined(__unix__) && !defined(__APPLE__)
+    std::string copy_;
+#endif
+};
+
+static std::string hexAround( const unsigned char* p, std::size_t size,
+                              std::size_t offset )
+{
+    std::ostringstream os;
+    std::size_t begin = offset > 8 ? offset-8 : 0;
+    std::size_t end = std::min( size, offset+8 );
+    os << std::hex;
+    for (std::size_t i = begin; i < end; ++i)
+        os << (i == offset ? " [" : " ") << (p[i] >> 4) << (p[i] & 15)
+           << (i == offset ? "]" : "");
+    return os.str();
+}
+
+// Replaces the file at path with the data, in one step if possible. The
+// temporary file is named for the process and call, so that two writers of
+// the same path do not write into each other's, and is synced before the
+// rename so that a crash leaves the old file or the new one.
+static bool writeFileAtomically( const void* data, std::size_t size,
+                                 const std::string& path )
+{
+    static std::atomic<unsigned> writes( 0 );
+    std::ostringstream name;
+#if defined(__unix__) || defined(__APPLE__)
+    name << path << ".tmp." << getpid() << "." << writes++;
+    std::string temp = name.str();
+    int fd = open( temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666 );
+    if (fd < 0)
+        return false;
+    const char* p = static_cast<const char*>( data );
+    std::size_t left = size;
+    while (left) {
+        ssize_t n = write( fd, p, left );
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        left -= std::size_t( n );
+    }
+    bool written = left == 0 && fsync( fd ) == 0;
+    if (close( fd ) != 0 || !written) {
+        unlink( temp.c_str() );
+        return false;
+    }
+#else
+    name << path << ".tmp." << std::this_thread::get_id() << "." << writes++;
+    std::string temp = name.str();
+    {
+        std::ofstream out( temp.c_str(), std::ios::binary | std::ios::trunc );
+        out.write( static_cast<const char*>( data ), std::streamsize( size ) );
+        if (!out.flush()) {
+            out.close();
+            std::remove( temp.c_str() );
+            return false;
+        }
+    }
+#endif
+    if (std::rename( temp.c_str(), path.c_str() ) == 0)
+        return true;
+#ifdef _WIN32
+    // Windows will not rename over an existing file
+    std::remove( path.c_str() );
+    if (std::rename( temp.c_str(), path.c_str() ) == 0)
+        return true;
+#endif
+    std::remove( temp.c_str() );
+    return false;
+}
+
+GoldenResult checkGoldenBytes( const void* data, std::size_t size,
+                               const std::string& path )
+{
+    GoldenResult result;
+    result.matches = false;
+    result.updated = false;
+    const unsigned char* bytes = static_cast<const unsigned char*>( data );
+    {
+        MappedFile golden( path );
+        if (!golden.ok()) {
+            result.problem = "golden file " + path + " can not be read";
+        } else {
+            std::size_t common = std::min( size, golden.size() );
+            std::size_t offset = firstMismatch( bytes, golden.data(), common );
+            std::ostringstream os;
+            if (offset < common) {
+                os << "differs from golden file " << path << " at byte "
+                   << offset << "\n   " << hexAround( bytes, size, offset )
+                   << " should be\n   "
+                   << hexAround( golden.data(), golden.size(), offset );
+            } else if (size != golden.size()) {
+                os << "is " << size << " bytes, golden file " << path
+                   << " is " << golden.size();
+            } else {
+                result.matches = true;
+            }
+            result.problem = os.str();
+        }
+    }
+
+    if (!result.matches && options().updateGolden) {
+        if (writeFileAtomically( data, size, path )) {
+            result.matches = true;
+            result.updated = true;
+        } else {
+            result.problem += " and can not be updated";
+        }
+    }
+    return result;
+}
+
+
+struct FixtureHeader {
+    char magic[16];
+    std::uint64_t elementSize;
+    std::uint64_t versionSize;          // The version string follows
+    std::uint64_t dataOffset;           // A multiple of 64
+    std::uint64_t dataSize;
+};
+
+static const char fixtureMagic[16] = "selftest fixtur";
+
+FixtureBytes cachedFixtureBytes(
+    const char* name,
+    const char* version,
+    std::size_t elementSize,
+    const std::function<void( std::vector<unsigned char>& )>& build )
+{
+    // Everything handed out is kept here until exit
+    static std::mutex keepLock;
+    static std::vector<std::unique_ptr<MappedFile>> keepMapped;
+    static std::vector<std::unique_ptr<std::vector<unsigned char>>> keepBuilt;
+
+    const std::string cacheDir = options().fixtureCache;
+    const std::string path = cacheDir + "/" + name + ".fixture";
+    const std::size_t versionSize = std::strlen( version );
+
+    if (!cacheDir.empty()) {
+        std::unique_ptr<MappedFile> file( new MappedFile( path ) );
+        FixtureHeader h;
+        if (file->ok() && file->size() >= sizeof h) {
+            std::memcpy( &h, file->data(), sizeof h );
+            if (std::memcmp( h.magic, fixtureMagic, sizeof h.magic ) == 0 &&
+                    h.elementSize == elementSize &&
+                    h.versionSize == versionSize &&
+                    sizeof h + versionSize <= h.dataOffset &&
+                    h.dataOffset + h.dataSize == file->size() &&
+                    std::memcmp( file->data() + sizeof h, version,
+                                 versionSize ) == 0) {
+                FixtureBytes bytes = { file->data() + h.dataOffset,
+                                       std::size_t( h.dataSize ) };
+                std::lock_guard<std::mutex> guard( keepLock );
+                keepMapped.push_back( std::move( file ) );
+                return bytes;
+            }
+        }
+    }
+
+    std::unique_ptr<std::vector<unsigned char>> built(
+            new std::vector<unsigned char> );
+    build( *built );
+    FixtureBytes bytes = { built->data(), built->size() };
+
+    if (!cacheDir.empty()) {
+        FixtureHeader h;
+        std::memcpy( h.magic, fixtureMagic, sizeof h.magic );
+        h.elementSize = elementSize;
+        h.versionSize = versionSize;
+        h.dataOffset = (sizeof h + versionSize + 63) / 64 * 64;
+        h.dataSize = built->size();
+        std::vector<unsigned char> image( h.dataOffset + h.dataSize, 0 );
+        std::memcpy( &image[0], &h, sizeof h );
+        std::memcpy( &image[sizeof h], version, versionSize );
+        if (!built->empty())
+            std::memcpy( &image[h.dataOffset], built->data(), built->size() );
+        if (!writeFileAtomically( image.data(), image.size(), path ))
+            note( ("fixture cache " + path + " can not be written").c_str(),
+                  __FILE__, __LINE__ );
+    }
+
+    std::lock_guard<std::mutex> guard( keepLock );
+    keepBuilt.push_back( std::move( built ) );
+    return bytes;
+}
+
+
+FuzzTarget *FuzzTarget::head_ = nullptr;
+
+FuzzTarget::FuzzTarget( FuzzFunc *ff, const char* ffName )
+    : fuzzfunc_( ff ),
+      next_( head_ ),
+      ffname_( ffName )
+{
+    head_ = this;
+}
+
+void FuzzTarget::fuzzOne( const std::uint8_t* data, std::size_t size )
+{
+    // SELFTEST_FUZZ_TARGET chooses when a program has several targets
+    static FuzzTarget *target = [] {
+        const char* wanted = std::getenv( "SELFTEST_FUZZ_TARGET" );
+        FuzzTarget *found = nullptr;
+        int count = 0;
+        for (FuzzTarget *t = head_; t; t = t->next_) {
+            ++count;
+            if (!wanted || std::string( wanted ) == t->ffname_)
+                found = t;
+        }
+        if (!found || (!wanted && count > 1)) {
+            std::cerr << "Set SELFTEST_FUZZ_TARGET to one of:";
+            for (FuzzTarget *t = head_; t; t = t->next_)
+                std::cerr << " " << t->ffname_;
+            std::cerr << std::endl;
+            std::abort();
+        }
+        return found;
+    }();
+
+    try {
+        target->fuzzfunc_( data, size );
+        return;
+    }
+    catch( const terminate_unittest& e ) {
+        // Message, already written
+    }
+    catch( const std::exception& e ) {
+        std::cerr << "Exception thrown during fuzz target '"
+                  << target->ffname_ << "': " << e.what() << "." << std::endl;
+    }
+    catch( ... ) {
+        std::cerr << "Exception of unknown type thrown during fuzz target '"
+                  << target->ffname_ << "'." << std::endl;
+    }
+    // A crash is how the fuzzer learns this input is interesting
+    std::abort();
+}
+
+static std::vector<std::string> listCorpus( const std::string& dir )
+{
+    std::vector<std::string> files;
+#if defined(__unix__) || defined(__APPLE__)
+    if (DIR *d = opendir( dir.c_str() )) {
+        while (dirent *entry = readdir( d )) {
+            std::string path = dir + "/" + entry->d_name;
+            struct stat st;
+            if (stat( path.c_str(), &st ) == 0 && S_ISREG( st.st_mode ))
+                files.push_back( path );
+        }
+        closedir( d );
+    }
+#endif
+    std::sort( files.begin(), files.end() );
+    return files;
+}
+
+static std::vector<std::uint8_t> readCorpusFile( const std::string& path )
+{
+    std::ifstream in( path.c_str(), std::ios::binary );
+    return std::vector<std::uint8_t>( std::istreambuf_iterator<char>( in ),
+                                      std::istreambuf_iterator<char>() );
+}
+
+void replayCorpus( FuzzFunc *ff, const char* ffName )
+{
+    const char* root = std::getenv( "SELFTEST_CORPUS" );
+    std::string dir = std::string( root ? root : "corpus" ) + "/" + ffName;
+    std::vector<std::string> files = listCorpus( dir );
+    if (files.empty()) {
+        // Passing would hide a mistyped or missing $SELFTEST_CORPUS
+        std::clog << "Fuzz target " << ffName << " has no corpus files in "
+                  << dir << std::endl;
+        return;
+    }
+
+    std::atomic<std::uint64_t> firstFailure( files.size() );
+    parallelFor( files.size(), 1,
+            [&]( std::uint64_t begin, std::uint64_t, unsigned ) {
+        std::vector<std::uint8_t> input = readCorpusFile( files[begin] );
+        QuietFailures quiet;
+        try {
+            ff( input.data(), input.size() );
+        }
+        catch( ... ) {
+            std::uint64_t current = firstFailure.load();
+            while (begin < current &&
+                   !firstFailure.compare_exchange_weak( current, begin ))
+                ;
+        }
+    } );
+    if (firstFailure == files.size())
+        return;
+
+    // Run the first failing input again, out loud this time
+    const std::string& path = files[firstFailure];
+    std::vector<std::uint8_t> input = readCorpusFile( path );
+    try {
+        ff( input.data(), input.size() );
+    }
+    catch( ... ) {
+        note( ("fuzz target " + std::string( ffName ) + " fails on corpus "
+               "file " + path).c_str(), path.c_str(), 1 );
+        throw;
+    }
+    thrower( failType::badunittest, "corpus result is not repeatable",
+             ffName, path.c_str(), 1 );
+}
+
+// Calls per second, to three digits with an SI prefix
+static std::string describeRate( double perSecond )
+{
+    const char* prefix = "";
+    for (const char* p : { "k", "M", "G" }) {
+        if (perSecond < 1000.)
+            break;
+        perSecond /= 1000.;
+        prefix = p;
+    }
+    std::ostringstream os;
+    os.precision( 3 );
+    os << perSecond << prefix;
+    return os.str();
+}
+
+void runConcurrent( ConcurrentFunc *cf, const char* cfName,
+                    unsigned numThreads, std::size_t iterations,
+                    const char* fileName, int lineNum )
+{
+    if (numThreads == 0)
+        numThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    const std::uint64_t seed = testSeed( cfName );
+    std::atomic<unsigned> arrived( 0 );
+    std::atomic<bool> stop( false );
+    std::exception_ptr error;
+    std::mutex errorLock;
+    std::vector<double> opsPerSecond( numThreads );
+    TestContext* context = TestContext::current();
+
+    auto work = [&]( unsigned thread ) {
+        TestContext::Scope scope( context, false );
+        testRng() = Rng( seed + thread );
+        // Wait for the others, so that the threads run together
+        ++arrived;
+        while (arrived < numThreads)
+            std::this_thread::yield();
+
+        auto start = std::chrono::steady_clock::now();
+        std::size_t i = 0;
+        try {
+            for (; i < iterations && !stop.load( std::memory_order_relaxed );
+                 ++i)
+                cf( thread, i );
+        }
+        catch( ... ) {
+            std::lock_guard<std::mutex> guard( errorLock );
+            if (!error)
+                error = std::current_exception();
+            stop = true;
+        }
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+        opsPerSecond[thread] = elapsed.count() > 0. ? i / elapsed.count() : 0.;
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < numThreads; ++t)
+        threads.emplace_back( work, t );
+    work( 0 );
+    for (auto& t : threads)
+        t.join();
+
+    if (error)
+        std::rethrow_exception( error );
+    if (!options().verbose)
+        return;
+
+    std::string message = std::string( cfName ) + " on " +
+            std::to_string( numThreads ) + " threads:";
+    for (double rate : opsPerSecond)
+        message += " " + describeRate( rate );
+    note( (message + " calls/s").c_str(), fileName, lineNum );
+}
+
+std::atomic<bool> BenchClock::tsc_( false );
+double BenchClock::nanosPerTick_ = 1.;
+double BenchClock::overheadTicks_ = 0.;
+
+double BenchClock::measureOverhead()
+{
+    // The least of several tries, as anything more is interference. Timing
+    // nothing measures the cost of a start() and a stop().
+    double least = std::numeric_limits<double>::max();
+    for (int attempt = 0; attempt < 20; ++attempt) {
+        const int calls = 100;
+        double total = 0.;
+        for (int i = 0; i < calls; ++i) {
+            std::uint64_t t = start();
+            total += double( stop() - t );
+        }
+        least = std::min( least, total / calls );
+    }
+    return least;
+}
+
+#ifdef SELFTEST_HAS_TSC
+// Ticks of the time stamp counter per nanosecond of steady_clock, over a
+// busy wait of the given length
+static double tscTicksPerNano( std::chrono::milliseconds wait )
+{
+    auto begin = std::chrono::steady_clock::now();
+    std::uint64_t tscBegin = __rdtsc();
+    auto end = begin;
+    while ((end = std::chrono::steady_clock::now()) - begin < wait)
+        ;
+    std::uint64_t tscEnd = __rdtsc();
+    return double( tscEnd - tscBegin ) / double( std::chrono::duration_cast<
+            std::chrono::nanoseconds>( end - begin ).count() );
+}
+#endif
+
+void BenchClock::calibrate()
+{
+    static std::once_flag once;
+    std::call_once( once, [] {
+#ifdef SELFTEST_HAS_TSC
+        // Only a TSC that is invariant (runs at the same rate whatever the
+        // processor's frequency and power state), with rdtscp, will do
+        unsigned eax, ebx, ecx, edx;
+        bool invariant = __get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) &&
+                         (edx & (1u << 8));
+        bool rdtscp = __get_cpuid( 0x80000001, &eax, &ebx, &ecx, &edx ) &&
+                      (edx & (1u << 27));
+        if (invariant && rdtscp) {
+            // Twice, and the two must agree, or the TSC cannot be trusted
+            double first = tscTicksPerNano( std::chrono::milliseconds( 10 ) );
+            double second = tscTicksPerNano( std::chrono::milliseconds( 10 ) );
+            if (first > 0. && std::fabs( first - second ) < first / 100.) {
+                nanosPerTick_ = 2. / (first + second);
+                tsc_ = true;
+            }
+        }
+#endif
+        overheadTicks_ = measureOverhead();
+    } );
+}
+
+std::string BenchClock::describe()
+{
+    calibrate();
+    std::ostringstream os;
+    os.precision( 3 );
+    if (tsc_)
+        os << "TSC at " << 1. / nanosPerTick_ << "GHz";
+    else
+        os << "steady_clock";
+    os << ", " << describeNanos( overheadTicks_ * nanosPerTick_ )
+       << " to time nothing";
+    return os.str();
+}
+
+const std::size_t Histogram::numBuckets;
+
+static int highestBit( std::uint64_t value )
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll( value );
+#else
+    int bit = 0;
+    while (value >>= 1)
+        ++bit;
+    return bit;
+#endif
+}
+
+// Values below 2^subBucketBits have a bucket each. After that each power of
+// two range has 2^(subBucketBits-1) buckets.
+std::size_t Histogram::bucketOf( std::uint64_t value )
+{
+    const std::uint64_t half = std::uint64_t( 1 ) << (subBucketBits-1);
+    if (value < 2*half)
+        return std::size_t( value );
+    int shift = highestBit( value ) - (subBucketBits-1);
+    return std::size_t( 2*half + (shift-1)*half + ((value >> shift) - half) );
+}
+
+std::uint64_t Histogram::bucketLow( std::size_t bucket )
+{
+    const std::uint64_t half = std::uint64_t( 1 ) << (subBucketBits-1);
+    if (bucket < 2*half)
+        return bucket;
+    std::uint64_t shift = (bucket - 2*half) / half + 1;
+    return (half + (bucket - 2*half) % half) << shift;
+}
+
+std::uint64_t Histogram::bucketHigh( std::size_t bucket )
+{
+    const std::uint64_t half = std::uint64_t( 1 ) << (subBucketBits-1);
+    if (bucket < 2*half)
+        return bucket;
+    std::uint64_t shift = (bucket - 2*half) / half + 1;
+    return bucketLow( bucket ) + ((std::uint64_t( 1 ) << shift) - 1);
+}
+
+void Histogram::record( std::uint64_t value, std::uint64_t count )
+{
+    counts_[bucketOf( value )] += count;
+    total_ += count;
+    min_ = std::min( min_, value );
+    max_ = std::max( max_, value );
+    sum_ += double( value ) * count;
+}
+
+std::uint64_t Histogram::percentile( double p ) const
+{
+    if (!total_)
+        return 0;
+    // A bound on the slowest call must hold for the slowest call
+    if (p >= 100.)
+        return max_;
+    if (p <= 0.)
+        return min_;
+    std::uint64_t rank = std::uint64_t( std::ceil( p / 100. * total_ ) );
+    rank = std::max<std::uint64_t>( 1, std::min( rank, total_ ) );
+    std::uint64_t seen = 0;
+    for (std::size_t b = 0; b < numBuckets; ++b) {
+        seen += counts_[b];
+        if (seen >= rank) {
+            // The middle of the bucket, within what was recorded
+            std::uint64_t low = bucketLow( b );
+            std::uint64_t mid = low + (bucketHigh( b ) - low) / 2;
+            return std::max( min_, std::min( max_, mid ) );
+        }
+    }
+    return max_;
+}
+
+Histogram& Histogram::operator+=( const Histogram& r )
+{
+    for (std::size_t b = 0; b < numBuckets; ++b)
+        counts_[b] += r.counts_[b];
+    total_ += r.total_;
+    min_ = std::min( min_, r.min_ );
+    max_ = std::max( max_, r.max_ );
+    sum_ += r.sum_;
+    return *this;
+}
+
+bool Histogram::operator==( const Histogram& r ) const
+{
+    return total_ == r.total_ && min() == r.min() && max_ == r.max_ &&
+           sum_ == r.sum_ && counts_ == r.counts_;
+}
+
+static void putVarint( std::string& out, std::uint64_t v )
+{
+    while (v >= 0x80) {
+        out += char( (v & 0x7f) | 0x80 );
+        v >>= 7;
+    }
+    out += char( v );
+}
+
+static std::uint64_t getVarint( const std::string& in, std::size_t& pos )
+{
+    std::uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.size())
+            break;
+        unsigned char c = in[pos++];
+        v |= std::uint64_t( c & 0x7f ) << shift;
+        if (!(c & 0x80))
+            return v;
+    }
+    thrower( failType::badarg, "histogram is truncated or corrupt", __func__,
+             __FILE__, __LINE__ );
+    return 0;
+}
+
+// Version, subBucketBits, min, max, sum (as its bits), then for each bucket
+// that is not empty, the number of empty buckets before it and its count
+std::string Histogram::serialize() const
+{
+    std::string out;
+    out += char( 1 );
+    out += char( subBucketBits );
+    putVarint( out, min() );
+    putVarint( out, max_ );
+    std::uint64_t sumBits;
+    std::memcpy( &sumBits, &sum_, sizeof sumBits );
+    putVarint( out, sumBits );
+    std::size_t last = 0;
+    for (std::size_t b = 0; b < numBuckets; ++b) {
+        if (counts_[b]) {
+            putVarint( out, b - last );
+            putVarint( out, counts_[b] );
+            last = b;
+        }
+    }
+    return out;
+}
+
+Histogram Histogram::deserialize( const std::string& bytes )
+{
+    if (bytes.size() < 2 || bytes[0] != 1 || bytes[1] != subBucketBits)
+        thrower( failType::badarg, "not a histogram of this version",
+                 __func__, __FILE__, __LINE__ );
+    Histogram h;
+    std::size_t pos = 2;
+    std::uint64_t min = getVarint( bytes, pos );
+    h.max_ = getVarint( bytes, pos );
+    std::uint64_t sumBits = getVarint( bytes, pos );
+    std::memcpy( &h.sum_, &sumBits, sizeof sumBits );
+    std::uint64_t b = 0;
+    while (pos < bytes.size()) {
+        b += getVarint( bytes, pos );
+        std::uint64_t count = getVarint( bytes, pos );
+        if (b >= numBuckets)
+            thrower( failType::badarg, "histogram bucket out of range",
+                     __func__, __FILE__, __LINE__ );
+        h.counts_[b] += count;
+        h.total_ += count;
+    }
+    if (h.total_)
+        h.min_ = min;
+    return h;
+}
+
+std::string Histogram::toBase64() const
+{
+    return encodeBase64( serialize() );
+}
+
+Histogram Histogram::fromBase64( const std::string& text )
+{
+    return deserialize( decodeBase64( text ) );
+}
+
+std::atomic<std::uint64_t>& SharedHistogram::nextId()
+{
+    static std::atomic<std::uint64_t> id( 1 );
+    return id;
+}
+
+SharedHistogram::Shard& SharedHistogram::shard()
+{
+    // The shard of the histogram this thread recorded in last
+    static thread_local std::uint64_t cachedId = 0;
+    static thread_local Shard* cached = nullptr;
+    if (cachedId == id_)
+        return *cached;
+
+    std::lock_guard<std::mutex> guard( lock_ );
+    auto mine = std::find_if( shards_.begin(), shards_.end(),
+            []( const std::unique_ptr<Shard>& s ) {
+                return s->owner == std::this_thread::get_id(); } );
+    if (mine == shards_.end()) {
+        shards_.emplace_back( new Shard );
+        mine = shards_.end() - 1;
+    }
+    cachedId = id_;
+    cached = mine->get();
+    return *cached;
+}
+
+void SharedHistogram::record( std::uint64_t value )
+{
+    // Only this thread writes its shard, so no read-modify-write is needed
+    Shard& s = shard();
+    auto& count = s.counts[Histogram::bucketOf( value )];
+    count.store( count.load( std::memory_order_relaxed ) + 1,
+                 std::memory_order_relaxed );
+    if (value < s.min.load( std::memory_order_relaxed ))
+        s.min.store( value, std::memory_order_relaxed );
+    if (value > s.max.load( std::memory_order_relaxed ))
+        s.max.store( value, std::memory_order_relaxed );
+    s.sum.store( s.sum.load( std::memory_order_relaxed ) + double( value ),
+                 std::memory_order_relaxed );
+}
+
+Histogram SharedHistogram::snapshot() const
+{
+    Histogram h;
+    std::lock_guard<std::mutex> guard( lock_ );
+    for (auto& s : shards_) {
+        for (std::size_t b = 0; b < Histogram::numBuckets; ++b) {
+            std::uint64_t count = s->counts[b].load( std::memory_order_relaxed );
+            h.counts_[b] += count;
+            h.total_ += count;
+        }
+        h.min_ = std::min( h.min_, s->min.load( std::memory_order_relaxed ) );
+        h.max_ = std::max( h.max_, s->max.load( std::memory_order_relaxed ) );
+        h.sum_ += s->sum.load( std::memory_order_relaxed );
+    }
+    return h;
+}
+
+static const char base64Digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string encodeBase64( const std::string& bytes )
+{
+    std::string out;
+    std::uint32_t bits = 0;
+    int numBits = 0;
+    for (unsigned char c : bytes) {
+        bits = (bits << 8) | c;
+        numBits += 8;
+        while (numBits >= 6) {
+            numBits -= 6;
+            out += base64Digits[(bits >> numBits) & 63];
+        }
+    }
+    if (numBits)
+        out += base64Digits[(bits << (6-numBits)) & 63];
+    while (out.size() % 4)
+        out += '=';
+    return out;
+}
+
+std::string decodeBase64( const std::string& text )
+{
+    std::string out;
+    std::uint32_t bits = 0;
+    int numBits = 0;
+    for (char c : text) {
+        if (c == '=')
+            break;
+        const char* digit = std::strchr( base64Digits, c );
+        if (!c || !digit)
+            thrower( failType::badarg, "not base64", __func__, __FILE__,
+                     __LINE__ );
+        bits = (bits << 6) | std::uint32_t( digit - base64Digits );
+        numBits += 6;
+        if (numBits >= 8) {
+            numBits -= 8;
+            out += char( (bits >> numBits) & 0xff );
+        }
+    }
+    return out;
+}
+
+std::string describeNanos( double nanos )
+{
+    const char* unit = "ns";
+    for (const char* u : { "us", "ms", "s" }) {
+        if (nanos < 1000.)
+            break;
+        nanos /= 1000.;
+        unit = u;
+    }
+    std::ostringstream os;
+    os.precision( 3 );
+    os << nanos << unit;
+    return os.str();
+}
+
+std::string describePercentiles( const Histogram& h, double unitNanos )
+{
+    std::ostringstream os;
+    const double ps[] = { 50., 90., 99., 99.9 };
+    const char* names[] = { "p50 ", " p90 ", " p99 ", " p99.9 " };
+    for (int i = 0; i < 4; ++i)
+        os << names[i] << describeNanos( h.percentile( ps[i] ) * unitNanos );
+    os << " max " << describeNanos( h.max() * unitNanos );
+    return os.str();
+}
+
+std::string LatencyResult::describe() const
+{
+    std::ostringstream os;
+    for (auto& b : exceeded) {
+        os << (&b == &exceeded.front() ? ": p" : ", p") << b.p << " of "
+           << describeNanos( nanos.percentile( b.p ) ) << " is over "
+           << describeNanos( double( b.limit.count() ) );
+    }
+    os << "\n    " << describePercentiles( nanos, 1. ) << " of "
+       << nanos.count() << " calls";
+    return os.str();
+}
+
+const std::uint64_t Benchmark::minBatchNanos;
+const std::uint64_t Benchmark::minBatches;
+const std::uint64_t Benchmark::maxSamples;
+const int Benchmark::noiseRetries;
+const std::uint64_t Benchmark::maxColdSamples;
+const std::uint64_t Benchmark::minColdSamples;
+const std::uint64_t Benchmark::turnNanos;
+
+// Plain data, so that it can be used by operator new at any time
+static thread_local AllocationCounts threadAllocations;
+
+bool trackingAllocations()
+{
+#ifdef TRACKALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+}
+
+AllocationCounts allocationCounts()
+{
+    return threadAllocations;
+}
+
+void resetAllocationPeak()
+{
+    threadAllocations.peakBytes = threadAllocations.liveBytes;
+}
+
+#ifdef TRACKALLOCATIONS
+
+// Blocks have a header holding their size, as large as their alignment
+static void* trackedAllocate( std::size_t size, std::size_t align )
+{
+    const std::size_t header = std::max( align, alignof( std::max_align_t ) );
+    void* block = nullptr;
+    if (align <= alignof( std::max_align_t ))
+        block = std::malloc( header + size );
+#if defined(__unix__) || defined(__APPLE__)
+    else if (posix_memalign( &block, align, header + size ) != 0)
+        block = nullptr;
+#endif
+    if (!block)
+        return nullptr;
+    *static_cast<std::size_t*>( block ) = size;
+    AllocationCounts& counts = threadAllocations;
+    ++counts.allocations;
+    counts.bytes += size;
+    counts.liveBytes += std::int64_t( size );
+    counts.peakBytes = std::max( counts.peakBytes, counts.liveBytes );
+    return static_cast<char*>( block ) + header;
+}
+
+static void trackedFree( void* p, std::size_t align )
+{
+    if (!p)
+        return;
+    const std::size_t header = std::max( align, alignof( std::max_align_t ) );
+    void* block = static_cast<char*>( p ) - header;
+    threadAllocations.liveBytes -= std::int64_t( *static_cast<std::size_t*>( block ) );
+    std::free( block );
+}
+
+static void* trackedNew( std::size_t size, std::size_t align )
+{
+    for (;;) {
+        if (void* p = trackedAllocate( size, align ))
+            return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+#endif      // TRACKALLOCATIONS
+
+bool BenchmarkTurns::await( int side )
+{
+    std::unique_lock<std::mutex> lock( mutex_ );
+    waiting_[side] = true;
+    changed_.notify_all();
+    changed_.wait( lock, [&] { return turn_ == side || stopped_; } );
+    waiting_[side] = false;
+    return turn_ == side;
+}
+
+void BenchmarkTurns::done( int side, double picosPerCall )
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    picos_[side] = picosPerCall;
+    turn_ = -1;
+    changed_.notify_all();
+}
+
+bool BenchmarkTurns::take( int side, double* picosPerCall )
+{
+    std::unique_lock<std::mutex> lock( mutex_ );
+    changed_.wait( lock, [&] { return waiting_[side] || finished_[side]; } );
+    if (finished_[side])
+        return false;
+    turn_ = side;
+    changed_.notify_all();
+    changed_.wait( lock, [&] { return turn_ != side || finished_[side]; } );
+    if (turn_ == side) {
+        turn_ = -1;
+        return false;
+    }
+    *picosPerCall = picos_[side];
+    return true;
+}
+
+void BenchmarkTurns::finish( int side )
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    finished_[side] = true;
+    changed_.notify_all();
+}
+
+void BenchmarkTurns::stop()
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    stopped_ = true;
+    changed_.notify_all();
+}
+
+Benchmark::Benchmark( const char* name, double seconds )
+    : baseName_( name ), name_( name ), seconds_( seconds ),
+      cold_( options().coldCache )
+{}
+
+std::size_t Benchmark::workloadSize( std::initializer_list<std::size_t> sizes )
+{
+    sizes_.assign( sizes.begin(), sizes.end() );
+    if (sizes_.empty())
+        return 0;
+    size_ = sizes_[std::min( sizeIndex_, sizes_.size()-1 )];
+    name_ = std::string( baseName_ ) + "/" + std::to_string( size_ );
+    return size_;
+}
+
+// First line of a small file, or "" if it can't be read
+static std::string readLine( const char* path )
+{
+    std::ifstream in( path );
+    std::string line;
+    std::getline( in, line );
+    return line;
+}
 
-    while (oldHead) {
-        // Unlink from old
-        tptr = oldHead;
-        oldHead = oldHead->next_;
-        // Link to end of new
-        tptr->next_ = newHead;
-        newHead = tptr;
+AllocationCounts Benchmark::startAllocations()
+{
+    pausedAllocations_ = 0;
+    pausedBytes_ = 0;
+    resetAllocationPeak();
+    return allocationCounts();
+}
+
+void Benchmark::stopAllocations( const AllocationCounts& before, std::uint64_t calls )
+{
+    if (!trackingAllocations())
+        return;
+    AllocationCounts after = allocationCounts();
+    timedCalls_ += calls;
+    allocations_ += after.allocations - before.allocations - pausedAllocations_;
+    allocatedBytes_ += after.bytes - before.bytes - pausedBytes_;
+    peakBytes_ = std::max( peakBytes_,
+                           std::uint64_t( after.peakBytes - before.liveBytes ) );
+}
+
+void Benchmark::makeCold() const
+{
+    if (coldInputs_.empty())
+        evictCaches();
+    for (auto& input : coldInputs_)
+        flushFromCaches( input.first, input.second );
+}
+
+std::size_t lastLevelCacheSize()
+{
+    static const std::size_t size = [] {
+        long bytes = 0;
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+        bytes = sysconf( _SC_LEVEL3_CACHE_SIZE );
+        if (bytes <= 0)
+            bytes = sysconf( _SC_LEVEL2_CACHE_SIZE );
+#endif
+        for (int index = 3; bytes <= 0 && index >= 0; --index) {
+            std::string path = "/sys/devices/system/cpu/cpu0/cache/index" +
+                               std::to_string( index ) + "/size";
+            std::string text = readLine( path.c_str() );
+            char* unit = nullptr;
+            bytes = std::strtol( text.c_str(), &unit, 10 );
+            if (unit && *unit == 'K')
+                bytes *= 1024;
+            else if (unit && *unit == 'M')
+                bytes *= 1024*1024;
+        }
+        return bytes > 0 ? std::size_t( bytes ) : std::size_t( 32 ) << 20;
+    }();
+    return size;
+}
+
+void evictCaches()
+{
+    static std::vector<unsigned char> buffer( lastLevelCacheSize() / 2 * 3 );
+    // Writing each line takes it away from every other core's cache too
+    for (std::size_t i = 0; i < buffer.size(); i += 64)
+        ++buffer[i];
+    doNotOptimize( buffer.data() );
+}
+
+void flushFromCaches( const void* data, std::size_t size )
+{
+#if defined(SELFTEST_HAS_TSC) && defined(__SSE2__)
+    const char* bytes = static_cast<const char*>( data );
+    for (std::size_t i = 0; i < size; i += 64)
+        _mm_clflush( bytes + i );
+    if (size)
+        _mm_clflush( bytes + size - 1 );
+    _mm_mfence();
+#else
+    (void)data;
+    (void)size;
+    evictCaches();
+#endif
+}
+
+double Benchmark::noiseOf( const Histogram& samples )
+{
+    double median = samples.percentile( 50. );
+    if (median <= 0.)
+        return 0.;
+    return (samples.percentile( 90. ) - samples.percentile( 10. )) / median;
+}
+
+std::string Benchmark::describeCold() const
+{
+    if (!coldSamples_.count())
+        return "";
+    std::ostringstream os;
+    os << std::left << std::setw( 32 ) << "  cold" << " " << std::right
+       << std::setw( 8 ) << describeNanos( coldNanosPerOp() ) << "/op  "
+       << describePercentiles( coldSamples_, .001 ) << "  ("
+       << coldSamples_.count() << " calls)";
+    return os.str();
+}
+
+std::string Benchmark::describe() const
+{
+    std::ostringstream os;
+    os << std::left << std::setw( 32 ) << name_ << " " << std::right
+       << std::setw( 8 ) << describeNanos( nanosPerOp() ) << "/op  "
+       << describePercentiles( samples_, .001 ) << "  (" << iterations_
+       << " calls)";
+    if (noisy()) {
+        os.precision( 2 );
+        os << "  noisy, spread " << noise() * 100. << "%";
     }
+    return os.str();
+}
 
-    // Now call them
-    // sttrace << "Starting unit tests...\n";
-    //runningUnitTests = true;
-    FailRatio rc {0,0};
-    while (newHead) {
-        failedTest = newHead->callUnitTest();
+static std::string onOff( const std::string& flag, bool invert = false )
+{
+    if (flag.empty())
+        return "unknown";
+    return (flag == "1" || flag == "on") != invert ? "on" : "off";
+}
+
+static Environment findEnvironment()
+{
+    Environment env;
+    env.cpus = std::thread::hardware_concurrency();
+    std::ifstream cpuinfo( "/proc/cpuinfo" );
+    std::string line;
+    while (env.cpu.empty() && std::getline( cpuinfo, line )) {
+        auto colon = line.find( ':' );
+        if (line.compare( 0, 10, "model name" ) == 0 && colon != std::string::npos)
+            env.cpu = line.substr( line.find_first_not_of( " \t", colon+1 ) );
+    }
+    if (env.cpu.empty())
+        env.cpu = "unknown";
+    env.governor = readLine( "/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor" );
+    if (env.governor.empty())
+        env.governor = "unknown";
+    std::string noTurbo = readLine( "/sys/devices/system/cpu/intel_pstate/no_turbo" );
+    env.turbo = noTurbo.empty()
+        ? onOff( readLine( "/sys/devices/system/cpu/cpufreq/boost" ) )
+        : onOff( noTurbo, true );
+    env.smt = onOff( readLine( "/sys/devices/system/cpu/smt/active" ) );
+#if defined(__unix__) || defined(__APPLE__)
+    struct utsname names;
+    if (uname( &names ) == 0)
+        env.kernel = std::string( names.sysname ) + " " + names.release + " " +
+                     names.machine;
+#endif
+#if defined(__clang__)
+    env.compiler = "clang " __clang_version__;
+#elif defined(__GNUC__)
+    env.compiler = "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+    env.compiler = "msvc " + std::to_string( _MSC_VER );
+#endif
+#if defined(__OPTIMIZE__)
+    env.compiler += " optimized";
+#else
+    env.compiler += " unoptimized";
+#endif
+#if defined(NDEBUG)
+    env.compiler += " NDEBUG";
+#endif
+#if defined(DEBUG)
+    env.compiler += " DEBUG";
+#endif
+#if defined(__AVX512F__)
+    env.compiler += " avx512";
+#elif defined(__AVX2__)
+    env.compiler += " avx2";
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+    env.compiler += " asan";
+#endif
+    std::istringstream( readLine( "/proc/loadavg" ) ) >> env.loadAverage;
+    return env;
+}
+
+const Environment& environment()
+{
+    static const Environment env = findEnvironment();
+    return env;
+}
+
+// FNV-1a
+std::uint64_t Environment::fingerprint() const
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const std::string* field : { &cpu, &governor, &turbo, &smt, &kernel,
+                                      &compiler }) {
+        for (char c : *field + '\n')
+            hash = (hash ^ static_cast<unsigned char>( c )) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string Environment::describe() const
+{
+    std::ostringstream os;
+    os << cpu << " x" << cpus << ", governor " << governor << ", turbo "
+       << turbo << ", smt " << smt << "\n    " << kernel << ", " << compiler
+       << ", load " << loadAverage;
+    return os.str();
+}
+
+// The first isolated CPU, or else the last one
+static int quietCpu()
+{
+    std::string isolated =
+        readLine( "/sys/devices/system/cpu/isolated" );
+    if (!isolated.empty() && std::isdigit( static_cast<unsigned char>( isolated[0] ) ))
+        return std::atoi( isolated.c_str() );
+    return int( std::max( 1u, std::thread::hardware_concurrency() ) ) - 1;
+}
+
+// The CPU the calling thread is on, or -1 if not known
+static int currentCpu()
+{
+#if defined(__linux__)
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+PinToCpu::PinToCpu( int cpu )
+{
+#if defined(__linux__)
+    if (cpu == -2)
+        cpu = quietCpu();
+    if (cpu < 0 || cpu >= CPU_SETSIZE ||
+        sched_getaffinity( 0, sizeof saved_, &saved_ ) != 0)
+        return;
+    cpu_set_t only;
+    CPU_ZERO( &only );
+    CPU_SET( cpu, &only );
+    if (sched_setaffinity( 0, sizeof only, &only ) == 0)
+        cpu_ = cpu;
+#else
+    (void)cpu;
+#endif
+}
+
+PinToCpu::~PinToCpu()
+{
+#if defined(__linux__)
+    if (cpu_ >= 0)
+        sched_setaffinity( 0, sizeof saved_, &saved_ );
+#endif
+}
+
+BenchmarkTarget *BenchmarkTarget::head_ = nullptr;
+const std::size_t BenchmarkTarget::minTurns;
+const std::size_t BenchmarkTarget::maxTurns;
+
+BenchmarkTarget::BenchmarkTarget( BenchmarkFunc *bf, const char* bfName,
+                                  const char* group, const char* type )
+    : benchfunc_( bf ), next_( head_ ), bfname_( bfName ), group_( group ),
+      type_( type )
+{
+    head_ = this;
+}
+
+// Baseline files have a line for each benchmark, its name and then fields
+// of the form key=value separated by spaces. A line named #environment
+// has the fingerprint of the machine and build they were taken on.
+typedef std::map<std::string, std::map<std::string, std::string>> Baseline;
+
+static Baseline readBaseline( const std::string& path )
+{
+    Baseline baseline;
+    std::ifstream in( path.c_str() );
+    std::string line;
+    while (std::getline( in, line )) {
+        std::istringstream fields( line );
+        std::string name, field;
+        if (!(fields >> name))
+            continue;
+        auto& entry = baseline[name];
+        while (fields >> field) {
+            auto equals = field.find( '=' );
+            if (equals != std::string::npos)
+                entry[field.substr( 0, equals )] = field.substr( equals+1 );
+        }
+    }
+    return baseline;
+}
+
+static void writeBaseline( const Baseline& baseline, const std::string& path )
+{
+    std::ostringstream out;
+    for (auto& entry : baseline) {
+        out << entry.first;
+        for (auto& field : entry.second)
+            out << " " << field.first << "=" << field.second;
+        out << "\n";
+    }
+    std::string text = out.str();
+    if (!writeFileAtomically( text.data(), text.size(), path ))
+        thrower( failType::badunittest, ("cannot write baseline " + path).c_str(),
+                 __func__, __FILE__, __LINE__ );
+}
+
+// Names in baselines have no spaces, which type names may
+static std::string baselineName( const Benchmark& b )
+{
+    std::string name = b.name();
+    std::replace( name.begin(), name.end(), ' ', '_' );
+    return name;
+}
+
+// Time of an instance of a TEMPLATE_BENCHMARK
+struct TemplateTiming {
+    const char* group;
+    const char* type;
+    std::size_t size;
+    double nanos;
+};
+
+// A table for each TEMPLATE_BENCHMARK of the time of each type for each
+// workload size, with the fastest marked
+static void describeTemplateTimings( const std::vector<TemplateTiming>& timings )
+{
+    std::vector<const char*> groups;
+    for (auto& t : timings) {
+        if (std::find( groups.begin(), groups.end(), t.group ) == groups.end())
+            groups.push_back( t.group );
+    }
+    for (auto group : groups) {
+        std::vector<const char*> types;
+        std::vector<std::size_t> sizes;
+        std::map<std::pair<std::size_t, const char*>, double> nanos;
+        for (auto& t : timings) {
+            if (t.group != group)
+                continue;
+            if (std::find( types.begin(), types.end(), t.type ) == types.end())
+                types.push_back( t.type );
+            if (std::find( sizes.begin(), sizes.end(), t.size ) == sizes.end())
+                sizes.push_back( t.size );
+            nanos[std::make_pair( t.size, t.type )] = t.nanos;
+        }
+        std::cout << "\n" << std::left << std::setw( 12 ) << group;
+        for (auto type : types)
+            std::cout << "  " << std::setw( std::max<std::size_t>( 10, std::strlen( type ) ) )
+                      << type;
+        std::cout << "  fastest\n";
+        for (auto size : sizes) {
+            const char* fastest = nullptr;
+            for (auto type : types) {
+                auto n = nanos.find( std::make_pair( size, type ) );
+                if (n != nanos.end() &&
+                    (!fastest || n->second < nanos[std::make_pair( size, fastest )]))
+                    fastest = type;
+            }
+            std::cout << std::setw( 12 ) << (size ? std::to_string( size ) : "");
+            for (auto type : types) {
+                auto n = nanos.find( std::make_pair( size, type ) );
+                std::string cell = n == nanos.end() ? "-" : describeNanos( n->second );
+                if (type == fastest)
+                    cell = "*" + cell;
+                std::cout << "  " << std::setw( std::max<std::size_t>( 10, std::strlen( type ) ) )
+                          << cell;
+            }
+            std::cout << "  " << (fastest ? fastest : "-") << "\n";
+        }
+        std::cout << std::right << std::flush;
+    }
+}
+
+// Rates of the bytes, items and counters of a benchmark, each compared with
+// the baseline, or "" if it has none
+static std::string describeCounters( const Benchmark& b, const Baseline& baseline )
+{
+    if (b.nanosPerOp() <= 0.)
+        return "";
+    std::map<std::string, std::string> was;
+    double wasNanos = 0.;
+    auto entry = baseline.find( baselineName( b ) );
+    if (entry != baseline.end() && entry->second.count( "samples" )) {
+        was = entry->second;
+        wasNanos = Histogram::fromBase64( was["samples"] ).percentile( 50. ) / 1000.;
+    }
+    std::ostringstream os;
+    os.precision( 3 );
+    bool first = true;
+    auto rate = [&]( const std::string& key, double perCall, const std::string& unit ) {
+        double perSecond = perCall * 1e9 / b.nanosPerOp();
+        os << (first ? "" : ", ");
+        if (key.compare( 0, 8, "counter." ) == 0)
+            os << key.substr( 8 ) << " " << perCall << "/op ";
+        os << describeRate( perSecond ) << unit;
+        first = false;
+        if (wasNanos > 0. && was.count( key )) {
+            double wasPerSecond = std::strtod( was[key].c_str(), nullptr ) * 1e9 / wasNanos;
+            if (wasPerSecond > 0.)
+                os << " (" << std::showpos << 100. * (perSecond-wasPerSecond) / wasPerSecond
+                   << std::noshowpos << "% vs " << describeRate( wasPerSecond ) << unit
+                   << ")";
+        }
+    };
+    if (b.bytesProcessed() > 0.)
+        rate( "bytes", b.bytesProcessed(), "B/s" );
+    if (b.itemsProcessed() > 0.)
+        rate( "items", b.itemsProcessed(), " items/s" );
+    for (auto& counter : b.counters()) {
+        double perCall = b.calls() ? counter.second / double( b.calls() ) : 0.;
+        rate( "counter." + counter.first, perCall, "/s" );
+    }
+    if (first)
+        return "";
+    return std::string( "  throughput " ) + os.str();
+}
+
+std::string Benchmark::describeThroughput() const
+{
+    return describeCounters( *this, Baseline() );
+}
+
+// Allocations per call and peak bytes, with any change from the baseline,
+// or "" if they were not counted
+static std::string describeAllocations( const Benchmark& b, const Baseline& baseline )
+{
+    if (!trackingAllocations())
+        return "";
+    std::map<std::string, std::string> was;
+    auto entry = baseline.find( baselineName( b ) );
+    if (entry != baseline.end())
+        was = entry->second;
+    std::ostringstream os;
+    os.precision( 3 );
+    auto value = [&]( const char* key, double now, const std::string& text,
+                      const std::string& unit ) {
+        os << text;
+        if (was.count( key )) {
+            double before = std::strtod( was[key].c_str(), nullptr );
+            if (std::fabs( now-before ) > .01 * std::max( 1., before ))
+                os << " (was " << describeRate( before ) << unit << ")";
+        }
+    };
+    os << "  allocations ";
+    value( "allocations", b.allocationsPerOp(),
+           describeRate( b.allocationsPerOp() ) + "/op", "/op" );
+    os << ", ";
+    value( "allocated", b.allocatedBytesPerOp(),
+           describeRate( b.allocatedBytesPerOp() ) + "B/op", "B/op" );
+    os << ", peak ";
+    value( "peak", double( b.peakBytes() ), describeRate( double( b.peakBytes() ) ) + "B",
+           "B" );
+    return os.str();
+}
+
+// Saves what the benchmark processed per call in its baseline entry
+static void saveCounters( const Benchmark& b, std::map<std::string, std::string>& entry )
+{
+    auto save = [&]( const std::string& key, double perCall ) {
+        std::ostringstream os;
+        os.precision( 9 );
+        os << perCall;
+        entry[key] = os.str();
+    };
+    if (b.bytesProcessed() > 0.)
+        save( "bytes", b.bytesProcessed() );
+    if (b.itemsProcessed() > 0.)
+        save( "items", b.itemsProcessed() );
+    for (auto& counter : b.counters())
+        save( "counter." + counter.first, b.calls() ? counter.second / double( b.calls() ) : 0. );
+    if (trackingAllocations()) {
+        save( "allocations", b.allocationsPerOp() );
+        save( "allocated", b.allocatedBytesPerOp() );
+        save( "peak", double( b.peakBytes() ) );
+    }
+}
+
+// Change in median time per call from the samples saved under key in the
+// baseline, after two spaces
+static std::string compareWithBaseline( const Benchmark& b, double nanos,
+                                        const Baseline& baseline,
+                                        const char* key )
+{
+    auto entry = baseline.find( baselineName( b ) );
+    if (entry == baseline.end() || !entry->second.count( key ))
+        return "";
+    Histogram before = Histogram::fromBase64( entry->second.at( key ) );
+    double was = before.percentile( 50. ) / 1000.;
+    if (was <= 0.)
+        return "";
+    std::ostringstream os;
+    os.precision( 3 );
+    os << "  " << std::showpos << 100. * (nanos - was) / was
+       << std::noshowpos << "% vs " << describeNanos( was );
+    return os.str();
+}
+
+static void describeEnvironment( const Environment& env )
+{
+    reportStream( std::cout ) << "Benchmarks on " << env.describe() << std::endl;
+    if (env.loadAverage > .5 * std::max( 1u, env.cpus ))
+        reportStream( std::clog ) << "The machine is busy, timings will be noisy"
+                                  << std::endl;
+}
+
+static void describeTiming( const PinToCpu& pin )
+{
+    if (options().pinCpu != -1 && pin.cpu() < 0)
+        reportStream( std::clog ) << "Cannot pin benchmarks to a CPU" << std::endl;
+    std::ostream& out = reportStream( std::cout );
+    out << "Benchmarks timed by " << BenchClock::describe();
+    if (pin.cpu() >= 0)
+        out << " on CPU " << pin.cpu();
+    out << std::endl;
+}
+
+FailRatio BenchmarkTarget::runBenchmarks( const std::string& pattern )
+{
+    std::vector<BenchmarkTarget*> targets;
+    for (BenchmarkTarget* t = head_; t; t = t->next_) {
+        if (std::string( t->bfname_ ).find( pattern ) != std::string::npos)
+            targets.push_back( t );
+    }
+    // In the order given
+    std::reverse( targets.begin(), targets.end() );
+
+    Baseline baseline;
+    if (!options().baseline.empty())
+        baseline = readBaseline( options().baseline );
+    // Benchmarks not run this time keep their old entries
+    Baseline saved;
+    if (!options().saveBaseline.empty())
+        saved = readBaseline( options().saveBaseline );
+
+    FailRatio rc { 0, 0 };
+    if (targets.empty())
+        return rc;
+
+    const Environment& env = environment();
+    describeEnvironment( env );
+    std::ostringstream fingerprint;
+    fingerprint << std::hex << env.fingerprint();
+    if (!baseline.empty() &&
+        baseline["#environment"]["fingerprint"] != fingerprint.str()) {
+        std::clog << "The baseline " << options().baseline << " is from a "
+                  << "different machine or build, not comparing with it"
+                  << std::endl;
+        baseline.clear();
+    }
+    // Old entries from elsewhere would be taken for this environment's
+    if (!saved.empty() &&
+        saved["#environment"]["fingerprint"] != fingerprint.str())
+        saved.clear();
+    saved["#environment"]["fingerprint"] = fingerprint.str();
+
+    PinToCpu pin( options().pinCpu );
+    describeTiming( pin );
+    std::vector<TemplateTiming> timings;
+    for (auto t : targets) {
+        // Once for each workload size it asks for
+        for (std::size_t index = 0, sizes = 1; index < sizes; ++index) {
+            ++rc.numTests;
+            TestContext context( t->bfname_ );
+            TestContext::Scope scope( &context, false );
+            try {
+                Benchmark b( t->bfname_, options().benchmarkSeconds );
+                b.sizeIndex_ = index;
+                t->benchfunc_( b );
+                sizes = std::max<std::size_t>( 1, b.sizes_.size() );
+                if (context.failed())
+                    std::rethrow_exception( context.firstFailure() );
+                std::cout << b.describe()
+                          << compareWithBaseline( b, b.nanosPerOp(), baseline, "samples" )
+                          << std::endl;
+                std::string counters = describeCounters( b, baseline );
+                if (!counters.empty())
+                    std::cout << counters << std::endl;
+                std::string allocations = describeAllocations( b, baseline );
+                if (!allocations.empty())
+                    std::cout << allocations << std::endl;
+                auto& entry = saved[baselineName( b )];
+                entry.clear();
+                entry["samples"] = b.samples().toBase64();
+                saveCounters( b, entry );
+                if (b.coldSamples().count()) {
+                    std::cout << b.describeCold()
+                              << compareWithBaseline( b, b.coldNanosPerOp(), baseline, "cold" )
+                              << std::endl;
+                    entry["cold"] = b.coldSamples().toBase64();
+                }
+                if (t->group_)
+                    timings.push_back( TemplateTiming{ t->group_, t->type_,
+                                                       b.workloadSize(), b.nanosPerOp() } );
+            }
+            catch( ... ) {
+                reportFailure( std::current_exception(), t->bfname_ );
+                ++rc.numFailedTests;
+            }
+        }
+    }
+    describeTemplateTimings( timings );
+    if (!options().saveBaseline.empty()) {
         ++rc.numTests;
-        if (failedTest) {
+        try {
+            writeBaseline( saved, options().saveBaseline );
+        }
+        catch( ... ) {
+            reportFailure( std::current_exception(), "save-baseline" );
             ++rc.numFailedTests;
         }
-        newHead = newHead->next_;
     }
-    //runningUnitTests = false;
+    return rc;
+}
+
+FailRatio BenchmarkTarget::compareBenchmarks( const std::string& first,
+                                              const std::string& second,
+                                              double seconds )
+{
+    BenchmarkTarget* targets[2] = { nullptr, nullptr };
+    for (BenchmarkTarget* t = head_; t; t = t->next_) {
+        if (first == t->bfname_)
+            targets[0] = t;
+        if (second == t->bfname_)
+            targets[1] = t;
+    }
+    std::string name = first + " vs " + second;
+    FailRatio rc { 0, 1 };
+    TestContext context( name.c_str() );
+    TestContext::Scope scope( &context, false );
+    try {
+        for (int side = 0; side < 2; ++side) {
+            if (!targets[side])
+                thrower( failType::badunittest,
+                         ("no benchmark named " + (side ? second : first)).c_str(),
+                         __func__, __FILE__, __LINE__ );
+        }
+        describeEnvironment( environment() );
+        // Both sides on the same CPU, or the difference is partly the CPUs'
+        PinToCpu pin( options().pinCpu == -1 ? currentCpu() : options().pinCpu );
+        BenchClock::calibrate();
+        describeTiming( pin );
+
+        // Threads started here inherit the pinning
+        BenchmarkTurns turns;
+        std::unique_ptr<Benchmark> benchmarks[2];
+        std::vector<double> differences;
+        {
+            TestThread threads[2];
+            for (int side = 0; side < 2; ++side) {
+                benchmarks[side].reset( new Benchmark( targets[side]->bfname_, seconds ) );
+                benchmarks[side]->turns_ = &turns;
+                benchmarks[side]->side_ = side;
+                threads[side] = TestThread( [&turns, &benchmarks, &targets, side] {
+                    try {
+                        targets[side]->benchfunc_( *benchmarks[side] );
+                    }
+                    catch( ... ) {
+                        turns.finish( side );
+                        throw;
+                    }
+                    turns.finish( side );
+                } );
+            }
+
+            // Each warms up, then they go in a random order each round
+            double picos[2];
+            bool ok = turns.take( 0, &picos[0] ) && turns.take( 1, &picos[1] );
+            std::mt19937_64 rng( std::random_device{}() );
+            typedef std::chrono::steady_clock steady;
+            auto until = steady::now() + std::chrono::duration_cast<steady::duration>(
+                                             std::chrono::duration<double>( 2.*seconds ) );
+            while (ok && differences.size() < maxTurns &&
+                   (differences.size() < minTurns || steady::now() < until)) {
+                int side = int( rng() & 1 );
+                ok = turns.take( side, &picos[side] ) && turns.take( 1-side, &picos[1-side] );
+                if (ok && picos[0] > 0.)
+                    differences.push_back( (picos[1]-picos[0]) / picos[0] );
+            }
+            turns.stop();
+        }
+        if (context.failed())
+            std::rethrow_exception( context.firstFailure() );
+        if (differences.size() < minTurns)
+            thrower( failType::badunittest, "both benchmarks call run() once",
+                     __func__, __FILE__, __LINE__ );
 
+        double mean = 0.;
+        for (double d : differences)
+            mean += d;
+        mean /= double( differences.size() );
+        double variance = 0.;
+        for (double d : differences)
+            variance += (d-mean) * (d-mean);
+        variance /= double( differences.size()-1 );
+        double interval = 1.96 * std::sqrt( variance / double( differences.size() ) );
+
+        std::ostream& out = reportStream( std::cout );
+        out << benchmarks[0]->describe() << "\n" << benchmarks[1]->describe()
+            << "\n" << second << " vs " << first << ": " << std::fixed
+            << std::setprecision( 2 ) << std::showpos << 100.*mean
+            << std::noshowpos << "% +-" << 100.*interval << "% time per call"
+            << std::defaultfloat << " (95% confidence, " << differences.size()
+            << " rounds), "
+            << (mean-interval > 0. ? "slower" : mean+interval < 0. ? "faster"
+                                                                : "no different")
+            << std::endl;
+    }
+    catch( ... ) {
+        reportFailure( std::current_exception(), name.c_str() );
+        ++rc.numFailedTests;
+    }
     return rc;
 }
 
+FailRatio runBenchmarks( const std::string& pattern )
+{
+    return BenchmarkTarget::runBenchmarks( pattern );
+}
 
-FailRatio runUnitTests()
+FailRatio compareBenchmarks( const std::string& first, const std::string& second,
+                             double seconds )
 {
-    return UnitTest::runUnitTestsImpl();
+    return BenchmarkTarget::compareBenchmarks( first, second, seconds );
 }
 
 #endif      // SELFTEST_IMPLEMENTATION
 
 }	// namespace st
 
+// TEST_FUNCTION finds the suite of the innermost TEST_SUITE around it, or
+// this one
+namespace selftest_suite {
+    inline selftest::Suite& current() { return selftest::defaultSuite(); }
+}
+
+#if defined(SELFTEST_IMPLEMENTATION) && defined(TRACETHROWS) && \
+    defined(TRACEALLTHROWS) && defined(__GNUC__) && !defined(_WIN32)
+
+// Every C++ throw passes through here on its way to the real __cxa_throw,
+// declared as <cxxabi.h> does
+namespace __cxxabiv1 {
+extern "C" __attribute__((noreturn))
+void __cxa_throw( void* object, std::type_info* type, void (*destroy)( void* ) )
+{
+    typedef void (*cxa_throw_type)( void*, std::type_info*, void (*)( void* ) );
+    static cxa_throw_type realThrow = reinterpret_cast<cxa_throw_type>(
+            dlsym( RTLD_NEXT, "__cxa_throw" ) );
+    if (selftest::tracingThrow) {
+        // Already recorded by thrower()
+        selftest::tracingThrow = false;
+    } else {
+        // Recording may itself throw (bad_alloc), which must not recurse
+        selftest::tracingThrow = true;
+        try {
+            selftest::reportedTracer().recordThrow(
+                    *type, __builtin_return_address( 0 ) );
+        }
+        catch( ... ) {
+        }
+        selftest::tracingThrow = false;
+    }
+    realThrow( object, type, destroy );
+    __builtin_unreachable();
+}
+}   // namespace __cxxabiv1
+
+#endif
+
+#if defined(SELFTEST_IMPLEMENTATION) && defined(TRACKALLOCATIONS)
+
+// Every allocation by new is counted for selftest::allocationCounts()
+void* operator new( std::size_t size )
+{
+    return selftest::trackedNew( size, 0 );
+}
+
+void* operator new[]( std::size_t size )
+{
+    return selftest::trackedNew( size, 0 );
+}
+
+void* operator new( std::size_t size, const std::nothrow_t& ) noexcept
+{
+    return selftest::trackedAllocate( size, 0 );
+}
+
+void* operator new[]( std::size_t size, const std::nothrow_t& ) noexcept
+{
+    return selftest::trackedAllocate( size, 0 );
+}
+
+void operator delete( void* p ) noexcept
+{
+    selftest::trackedFree( p, 0 );
+}
+
+void operator delete[]( void* p ) noexcept
+{
+    selftest::trackedFree( p, 0 );
+}
+
+void operator delete( void* p, const std::nothrow_t& ) noexcept
+{
+    selftest::trackedFree( p, 0 );
+}
+
+void operator delete[]( void* p, const std::nothrow_t& ) noexcept
+{
+    selftest::trackedFree( p, 0 );
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete( void* p, std::size_t ) noexcept
+{
+    selftest::trackedFree( p, 0 );
+}
+
+void operator delete[]( void* p, std::size_t ) noexcept
+{
+    selftest::trackedFree( p, 0 );
+}
+#endif
+
+#if defined(__cpp_aligned_new) && (defined(__unix__) || defined(__APPLE__))
+void* operator new( std::size_t size, std::align_val_t align )
+{
+    return selftest::trackedNew( size, std::size_t( align ) );
+}
+
+void* operator new[]( std::size_t size, std::align_val_t align )
+{
+    return selftest::trackedNew( size, std::size_t( align ) );
+}
+
+void* operator new( std::size_t size, std::align_val_t align,
+                    const std::nothrow_t& ) noexcept
+{
+    return selftest::trackedAllocate( size, std::size_t( align ) );
+}
+
+void* operator new[]( std::size_t size, std::align_val_t align,
+                      const std::nothrow_t& ) noexcept
+{
+    return selftest::trackedAllocate( size, std::size_t( align ) );
+}
+
+void operator delete( void* p, std::align_val_t align ) noexcept
+{
+    selftest::trackedFree( p, std::size_t( align ) );
+}
+
+void operator delete[]( void* p, std::align_val_t align ) noexcept
+{
+    selftest::trackedFree( p, std::size_t( align ) );
+}
+
+void operator delete( void* p, std::size_t, std::align_val_t align ) noexcept
+{
+    selftest::trackedFree( p, std::size_t( align ) );
+}
+
+void operator delete[]( void* p, std::size_t, std::align_val_t align ) noexcept
+{
+    selftest::trackedFree( p, std::size_t( align ) );
+}
+
+void operator delete( void* p, std::align_val_t align, const std::nothrow_t& ) noexcept
+{
+    selftest::trackedFree( p, std::size_t( align ) );
+}
+
+void operator delete[]( void* p, std::align_val_t align, const std::nothrow_t& ) noexcept
+{
+    selftest::trackedFree( p, std::size_t( align ) );
+}
+#endif
+
+#endif
+
+#if defined(SELFTEST_IMPLEMENTATION) && defined(SELFTEST_FUZZ)
+
+// Entry point for libFuzzer and compatible fuzzers
+extern "C" int LLVMFuzzerTestOneInput( const std::uint8_t* data,
+                                       std::size_t size )
+{
+    selftest::FuzzTarget::fuzzOne( data, size );
+    return 0;
+}
+
+#endif
+
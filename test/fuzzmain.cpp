@@ -0,0 +1,10 @@
+/*
+    Fuzzer entry point for the fuzz targets of testception.
+
+    libFuzzer supplies main(), so this only provides the selftest
+    implementation with LLVMFuzzerTestOneInput() enabled. See "make fuzz".
+*/
+
+#define SELFTEST_FUZZ
+#define SELFTEST_IMPLEMENTATION
+#include "selftest.hpp"
@@ -8,16 +8,26 @@
 #include <iostream>
 
 #define TRACING 1
+//#define STACKTRACES
+//#define TRACETHROWS
+//#define TRACEALLTHROWS
+#define TRACKALLOCATIONS
 #define SELFTEST_IMPLEMENTATION
 #include "selftest.hpp"
 
+// In testception.cpp
+bool parallelSuiteToreDown();
+
 int main( int argc, char *argv[] )
 {
     selftest::trace << "Starting test sequence. "
              "5 failures expected during this test.\n\n\n";
-    auto fails = selftest::runUnitTests();
+    auto fails = selftest::runUnitTests( argc, argv );
+    bool toreDown = parallelSuiteToreDown();
+    if ( !toreDown )
+        std::cerr << "SUITE_TEARDOWN did not run after SUITE_SETUP\n";
 
-    if ( 5==fails.numFailedTests ) {
+    if ( 5==fails.numFailedTests && toreDown ) {
         selftest::trace << "\n\n\nTestception completed successfully\n";
         return 0;
     } else {
@@ -6,18 +6,45 @@ See the attached 'LICENSE-MIT.txt' file for a licence to use this software and
 IMPORTANT DISCLAIMERS.
 */
 
-//#define TRACETHROWS
 #define TRACING 1
 #include "selftest.hpp"
 
 #include <iostream>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <sstream>
+#include <tuple>
+#include <typeinfo>
+#include <numeric>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <future>
+#include <map>
+#include <set>
+#include <functional>
+#include <random>
+#if defined(__unix__) || defined(__APPLE__)
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
 
 namespace {
 
-using std::this_thread::sleep_for;
 using std::chrono::seconds;
+using std::chrono::milliseconds;
 using selftest::selftest_error;
 using selftest::over_reasonable_limit;
 using std::cerr;
@@ -41,6 +68,818 @@ TEST_FUNCTION( try_throws )
     CHECKIFTHROWS( TEST_FAIL( "TEST_FAIL" ), selftest_error );
 }
 
+TEST_FUNCTION( virtual_clock )
+{
+    typedef selftest::clock clock;
+    auto start = clock::now();
+    clock::sleep_for( seconds(1) );
+    CHECKIF( clock::now()-start == seconds(1) );
+
+    clock::sleep_until( start );            // Never goes backwards
+    CHECKIF( clock::now()-start == seconds(1) );
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::unique_lock<std::mutex> lock( m );
+    bool ready = false;
+    CHECKIF( !clock::wait_for( cv, lock, milliseconds(500),
+                               [&]{ return ready; } ) );
+    CHECKIF( clock::now()-start == milliseconds(1500) );
+    ready = true;
+    CHECKIF( clock::wait_for( cv, lock, seconds(5), [&]{ return ready; } ) );
+    CHECKIF( clock::now()-start == milliseconds(1500) );
+
+    clock::autoAdvance( milliseconds(1) );
+    auto t1 = clock::now();
+    auto t2 = clock::now();
+    clock::autoAdvance( clock::duration::zero() );
+    CHECKIF( t2-t1 == milliseconds(1) );
+}
+
+TEST_FUNCTION( check_for_all )
+{
+    CHECK_FOR_ALL( selftest::allValues<uint16_t>(), []( uint16_t x ) {
+        return uint16_t( ~~x ) == x; } );
+    CHECK_FOR_ALL( selftest::range( -1000, 1000 ), []( int x ) {
+        return x*x >= 0; } );
+    CHECK_FOR_ALL( std::vector<double>( { 1., 4., 9. } ), []( double x ) {
+        return x > 0.; } );
+
+    auto odd = selftest::checkForAll( selftest::range<uint32_t>( 0, 100000 ),
+                                      []( uint32_t x ) { return x%2 == 0; } );
+    CHECKIF( odd.numFailed == 50000 );
+    CHECKIF( odd.numChecked == 100000 );
+    CHECKIF( odd.firstFailures.size() == selftest::forAllReported );
+    CHECKIF( odd.firstFailures[0] == 1 && odd.firstFailures[7] == 15 );
+
+    // Bytes are given as numbers
+    auto negative = selftest::checkForAll( selftest::allValues<int8_t>(),
+                                           []( int8_t x ) { return x >= 0; } );
+    CHECKIF( negative.describe().find( "first failing: -128 -127" ) != std::string::npos );
+    auto high = selftest::checkForAll( selftest::allValues<uint8_t>(),
+                                       []( uint8_t x ) { return x < 65; } );
+    CHECKIF( high.describe().find( "first failing: 65 66" ) != std::string::npos );
+
+    auto floats = selftest::allBitPatterns<float>();
+    CHECKIF( floats.size() == uint64_t(1) << 32 );
+    CHECKIF( floats[0x3f800000] == 1.f );
+    CHECKIF( floats[0x7fc00000] != floats[0x7fc00000] );
+}
+
+uint32_t popcount_loop( uint32_t x )
+{
+    uint32_t n = 0;
+    for (; x; x >>= 1)
+        n += x & 1;
+    return n;
+}
+
+uint32_t popcount_swar( uint32_t x )
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    return (((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+TEST_FUZZ( fuzz_popcount, data, size )
+{
+    for (size_t i = 0; i+4 <= size; i += 4) {
+        uint32_t x;
+        memcpy( &x, data+i, 4 );
+        CHECKIF( popcount_swar( x ) == popcount_loop( x ) );
+    }
+}
+
+TEST_FUNCTION( check_equivalent )
+{
+    auto hash = []( uint64_t i ) { return uint32_t( i*2654435761u ); };
+    CHECK_EQUIVALENT( popcount_swar, popcount_loop, hash, 100000 );
+    CHECK_EQUIVALENT_CMP( popcount_swar, popcount_loop, hash, 1000,
+                          []( uint32_t a, uint32_t b ) { return a <= b; } );
+
+    auto off = selftest::checkEquivalent(
+                    []( uint32_t x ) { return x < 2000 ? x : x+1; },
+                    []( uint32_t x ) { return x; },
+                    []( uint64_t i ) { return uint32_t( i ); },
+                    3000, selftest::EqualTo() );
+    CHECKIF( off.numFailed == 1000 );
+    CHECKIF( off.firstMismatches.size() == selftest::forAllReported );
+    CHECKIF( off.firstMismatches[0].index == 2000 );
+    CHECKIF( off.firstMismatches[0].fast == 2001 );
+    CHECKIF( off.firstMismatches[0].reference == 2000 );
+    CHECKIF( off.speedup() > 0. );
+}
+
+PROPERTY_TEST( property_of_integers,
+               selftest::integers( -1000, 1000 ), selftest::integers<uint8_t>() )
+    ( int a, uint8_t b )
+{
+    CHECKIF( a+b == b+a );
+    CHECKIF( a >= -1000 && a <= 1000 );
+}
+
+PROPERTY_TEST_N( property_of_composites, 200,
+                 selftest::vectorsOf( selftest::reals( -1., 1. ), 20 ),
+                 selftest::tuples( selftest::booleans(), selftest::just( 'x' ) ),
+                 selftest::filter( selftest::integers( 0, 100 ),
+                                   []( int i ) { return i%2 == 0; } ) )
+    ( std::vector<double> v, std::tuple<bool,char> t, int even )
+{
+    CHECKIF( v.size() <= 20 );
+    for (auto x : v)
+        CHECKIF( x >= -1. && x <= 1. );
+    CHECKIF( std::get<1>( t ) == 'x' );
+    CHECKIF( even%2 == 0 );
+}
+
+TEST_FUNCTION( property_shrinking )
+{
+    auto ints = selftest::integers( -100, 100 );
+    int shrunk = 0;
+    CHECKIF( ints.shrink( 100, 0, shrunk ) && shrunk == 0 );
+    CHECKIF( ints.shrink( 100, 1, shrunk ) && shrunk == 50 );
+    CHECKIF( ints.shrink( -100, 2, shrunk ) && shrunk == -75 );
+    CHECKIF( !ints.shrink( 0, 0, shrunk ) );
+
+    auto vectors = selftest::vectorsOf( selftest::integers( 0, 9 ) );
+    std::vector<int> v = { 3, 4 }, out;
+    CHECKIF( vectors.shrink( v, 0, out ) && out == std::vector<int>( { 4 } ) );
+    CHECKIF( vectors.shrink( v, 2, out ) && out == std::vector<int>( { 0, 4 } ) );
+
+    // The size is drawn first, then each element
+    selftest::Rng rng( 1 ), first( 1 );
+    std::vector<int> drawn = vectors( rng );
+    CHECKIF( drawn.size() == first.below( 101 ) );
+    bool distinct = false;
+    for (int i = 0; i < 20 && !distinct; ++i) {
+        drawn = vectors( rng );
+        distinct = std::count( drawn.begin(), drawn.end(), drawn.empty() ? 0 : drawn[0] ) !=
+                   std::ptrdiff_t( drawn.size() );
+    }
+    CHECKIF( distinct );
+
+    // Shrinking finds the boundary of a property, quietly
+    auto gens = std::make_tuple( selftest::integers( 0, 1000000 ) );
+    void (*below1000)( int ) = []( int i ) { CHECKIF( i < 1000 ); };
+    std::stringstream report;
+    bool failed = false;
+    try {
+        selftest::QuietFailures quiet;
+        selftest::CaptureReports capture( report );
+        selftest::checkProperty( "below1000", gens, below1000, 1000,
+                                 __FILE__, __LINE__ );
+    }
+    catch( const selftest::terminate_unittest& ) {
+        failed = true;
+    }
+    CHECKIF( failed );
+    CHECKIF( report.str().find( "property below1000 falsified" ) != std::string::npos );
+    CHECKIF( report.str().find( "counterexample (1000)" ) != std::string::npos );
+}
+
+TEST_FUNCTION( floating_point_checks )
+{
+    CHECK_NEAR( std::sqrt( 2. ), 1.41421356, 1e-8, 0. );
+    CHECK_NEAR( 1e20 + 1e5, 1e20, 0., 1e-12 );
+    CHECK_ULP( 1.f, std::nextafter( 1.f, 2.f ), 1 );
+    CHECK_ULP( -0., 0., 0 );
+    CHECKIF( selftest::ulpDistance( -std::numeric_limits<float>::denorm_min(),
+                                    std::numeric_limits<float>::denorm_min() ) == 2 );
+    CHECKIF( !selftest::near( std::nan( "" ), std::nan( "" ), 1., 1. ) );
+
+    std::vector<float> out( 1000 ), expected( 1000 );
+    for (size_t i = 0; i < out.size(); ++i)
+        out[i] = expected[i] = float( i ) / 7.f;
+    CHECK_ALL_ULP( out.data(), expected.data(), out.size(), 0 );
+    CHECK_ALL_NEAR( out.data(), expected.data(), out.size(), 0.f, 1e-6f );
+
+    out[10] = std::nextafter( std::nextafter( out[10], 0.f ), 0.f );
+    out[20] = std::nan( "" );
+    auto ulps = selftest::checkAllUlp( out.data(), expected.data(), out.size(), 1 );
+    CHECKIF( ulps.numFailed == 2 );
+    CHECKIF( ulps.worstIndex == 20 );
+    CHECKIF( ulps.histogram[0] == 998 );
+    CHECKIF( ulps.histogram[1] == 1 );
+    CHECKIF( ulps.histogram[selftest::FloatCheckResult::numBuckets-1] == 1 );
+
+    out[20] = expected[20] + 0.5f;
+    auto near = selftest::checkAllNear( out.data(), expected.data(), out.size(),
+                                        0.1f, 0.f );
+    CHECKIF( near.numFailed == 1 );
+    CHECKIF( near.worstIndex == 20 );
+    CHECKIF( near.histogram[3] == 1 );
+}
+
+TEST_FUNCTION( golden_files )
+{
+    // Named for this run, so that two runs at once do not share it
+    const char* tmp = std::getenv( "TMPDIR" );
+    std::ostringstream name;
+    name << (tmp ? tmp : "/tmp") << "/testception." << std::random_device{}() << ".golden";
+    std::string path = name.str();
+    std::string output( 100000, 'x' );
+
+    auto missing = selftest::checkGolden( output, path );
+    CHECKIF( !missing.matches && !missing.updated );
+
+    selftest::options().updateGolden = true;
+    auto updated = selftest::checkGolden( output, path );
+#if defined(__unix__) || defined(__APPLE__)
+    // A file that cannot be replaced is left alone, not removed first
+    std::string dir = path + ".dir";
+    CHECKIF( mkdir( dir.c_str(), 0700 ) == 0 );
+    auto blocked = selftest::checkGolden( output, dir );
+    struct stat st;
+    CHECKIF( !blocked.matches && stat( dir.c_str(), &st ) == 0 && S_ISDIR( st.st_mode ) );
+    rmdir( dir.c_str() );
+#endif
+    selftest::options().updateGolden = false;
+    CHECKIF( updated.matches && updated.updated );
+    CHECK_MATCHES_GOLDEN( output, path );
+
+    std::vector<char> changed( output.begin(), output.end() );
+    changed[70000] = 'y';
+    auto differs = selftest::checkGolden( changed, path );
+    CHECKIF( !differs.matches );
+    CHECKIF( differs.problem.find( "at byte 70000" ) != std::string::npos );
+    CHECKIF( differs.problem.find( "[79]" ) != std::string::npos );
+
+    auto shorter = selftest::checkGolden( output.substr( 0, 10 ), path );
+    CHECKIF( !shorter.matches );
+    std::remove( path.c_str() );
+
+    unsigned char a[] = "0123456789abcdefghij";
+    unsigned char b[] = "0123456789abcdefghiJ";
+    CHECKIF( selftest::firstMismatch( a, b, 20 ) == 19 );
+    CHECKIF( selftest::firstMismatch( a, b, 19 ) == 19 );
+}
+
+int squaresBuilt = 0;
+
+TEST_FIXTURE( std::vector<int>, squares )
+{
+    ++squaresBuilt;
+    std::vector<int> v;
+    for (int i = 0; i < 1000; ++i)
+        v.push_back( i*i );
+    return v;
+}
+
+TEST_FUNCTION( fixture_is_built_once )
+{
+    CHECKIF( squares()[30] == 900 );
+    CHECKIF( &squares() == &squares() );
+    CHECKIF( squaresBuilt == 1 );
+}
+
+TEST_FIXTURE_CACHED( double, thirds, "1" )
+{
+    return std::vector<double>( 3, 1./3. );
+}
+
+TEST_FUNCTION( fixture_is_shared )
+{
+    CHECKIF( squares().size() == 1000 );
+    CHECKIF( squaresBuilt == 1 );
+    CHECKIF( thirds().size() == 3 && thirds()[2] == 1./3. );
+}
+
+TEST_FUNCTION( fixture_cache )
+{
+    const char* tmp = std::getenv( "TMPDIR" );
+    std::string savedCache = selftest::options().fixtureCache;
+    selftest::options().fixtureCache = tmp ? tmp : "/tmp";
+    std::string path = selftest::options().fixtureCache + "/cubes.fixture";
+    std::remove( path.c_str() );
+
+    int built = 0;
+    auto cubes = [&] {
+        ++built;
+        std::vector<int64_t> v;
+        for (int64_t i = 0; i < 100; ++i)
+            v.push_back( i*i*i );
+        return v;
+    };
+    auto first = selftest::cachedFixture<int64_t>( "cubes", "v1", cubes );
+    auto second = selftest::cachedFixture<int64_t>( "cubes", "v1", cubes );
+    CHECKIF( built == 1 );
+    CHECKIF( second.size() == 100 && second[99] == 970299 );
+    CHECKIF( reinterpret_cast<uintptr_t>( second.data() ) % 64 == 0 );
+    CHECKIF( std::equal( first.begin(), first.end(), second.begin() ) );
+
+    auto third = selftest::cachedFixture<int64_t>( "cubes", "v2", cubes );
+    CHECKIF( built == 2 );
+    CHECKIF( third.size() == 100 );
+
+    std::remove( path.c_str() );
+    selftest::options().fixtureCache = savedCache;
+}
+
+TEST_SUITE( parallel_suite, selftest::Concurrency::parallel, "counter" )
+{
+    int setups = 0;
+    int teardowns = 0;
+    std::atomic<int> inSuite( 0 );
+
+    SUITE_SETUP()
+    {
+        ++setups;
+    }
+
+    SUITE_TEARDOWN()
+    {
+        ++teardowns;
+    }
+
+    // "counter" is held by one test at a time, even in a parallel suite
+    TEST_FUNCTION( suite_setup_runs_first )
+    {
+        CHECKIF( ++inSuite == 1 );
+        CHECKIF( setups == 1 && teardowns == 0 );
+        --inSuite;
+    }
+
+    TEST_FUNCTION( suite_setup_runs_once )
+    {
+        CHECKIF( ++inSuite == 1 );
+        CHECKIF( setups == 1 && teardowns == 0 );
+        --inSuite;
+    }
+}
+
+TEST_SUITE( exclusive_suite, selftest::Concurrency::exclusive )
+{
+    TEST_FUNCTION( suite_runs_alone )
+    {
+        CHECKIF( parallel_suite::inSuite == 0 );
+    }
+}
+
+TEST_SUITE_REOPEN( parallel_suite )
+{
+    // In the suite, so after its setup and holding "counter"
+    TEST_FUNCTION( suite_reopened )
+    {
+        CHECKIF( ++inSuite == 1 );
+        CHECKIF( setups == 1 && teardowns == 0 );
+        --inSuite;
+    }
+}
+
+TEST_FUNCTION( per_test_rng )
+{
+    selftest::Rng expected( selftest::testSeed( "per_test_rng" ) );
+    CHECKIF( selftest::testRng().next() == expected.next() );
+    CHECKIF( selftest::testSeed( "per_test_rng" ) !=
+             selftest::testSeed( "other_test" ) );
+}
+
+TEST_FUNCTION( throw_tracer )
+{
+    selftest::ThrowTracer tracer;
+    for (int i = 0; i < 5; ++i)
+        tracer.recordThrower( selftest::failType::badarg, "f", "a.cpp", 10 );
+    tracer.recordThrower( selftest::failType::overlimit, "g", "b.cpp", 20 );
+    for (int i = 0; i < 9; ++i)
+        tracer.recordThrow( typeid( std::out_of_range ), &i );
+    CHECKIF( tracer.numThrows() == 15 );
+
+    std::ostringstream report;
+    tracer.report( report );
+    std::string r = report.str();
+    CHECKIF( r.find( "15 exceptions thrown from 3 sites" ) == 0 );
+    auto outOfRange = r.find( "std::out_of_range" );
+    auto badArg = r.find( "std::invalid_argument (BAD_ARG)" );
+    auto overLimit = r.find( "selftest::over_reasonable_limit" );
+    CHECKIF( outOfRange < badArg && badArg < overLimit );
+    CHECKIF( r.find( "a.cpp:10 in f" ) != std::string::npos );
+}
+
+TEST_FUNCTION( stack_traces )
+{
+    selftest::StackTrace stack;
+    stack.numFrames = selftest::captureStack( stack.frames,
+                                              selftest::StackTrace::maxFrames );
+    try {
+        throw selftest::WithStackTrace<std::invalid_argument>( "bad", stack );
+    }
+    catch( const std::invalid_argument& e ) {
+        auto trace = dynamic_cast<const selftest::StackTrace*>( &e );
+        CHECKIF( trace && trace->numFrames == stack.numFrames );
+        CHECKIF( std::string( e.what() ) == (stack.numFrames ?
+                "bad\n" + stack.describe() : std::string( "bad" )) );
+    }
+
+    // One exception read on several threads at once is named once
+    std::exception_ptr shared = std::make_exception_ptr(
+            selftest::WithStackTrace<std::runtime_error>( "shared", stack ) );
+    std::vector<std::string> whats( 4 );
+    {
+        std::vector<selftest::TestThread> readers;
+        for (std::size_t t = 0; t < whats.size(); ++t) {
+            readers.emplace_back( [&shared, &whats, t] {
+                try {
+                    std::rethrow_exception( shared );
+                }
+                catch( const std::exception& e ) {
+                    whats[t] = e.what();
+                }
+            } );
+        }
+    }
+    CHECKIF( std::count( whats.begin(), whats.end(), whats[0] ) == 4 );
+    CHECKIF( whats[0].compare( 0, 6, "shared" ) == 0 );
+}
+
+TEST_CONCURRENT( concurrent_calls, 3, 1000 )( unsigned thread, std::size_t i )
+{
+    CHECKIF( thread < 3 && i < 1000 );
+}
+
+TEST_FUNCTION( concurrent_results )
+{
+    static std::atomic<std::uint64_t> sum( 0 );
+    selftest::runConcurrent( []( unsigned, std::size_t i ) { sum += i; },
+                             "sum", 4, 1000, __FILE__, __LINE__ );
+    CHECKIF( sum == 4 * (999*1000/2) );
+
+    // The first failure stops every thread and fails the test
+    CHECKIFTHROWS( selftest::runConcurrent( []( unsigned, std::size_t i ) {
+                       if (i == 10)
+                           throw std::runtime_error( "worker failed" );
+                   }, "throws", 2, 100000000, __FILE__, __LINE__ ),
+                   std::runtime_error );
+}
+
+TEST_FUNCTION( checks_on_other_threads )
+{
+    selftest::TestContext context( "inner" );
+    selftest::TestContext::Scope scope( &context, false );
+
+    // A thread for the test fails it rather than the program
+    selftest::TestContext* seen = nullptr;
+    selftest::TestThread( [&] {
+        seen = selftest::TestContext::current();
+        selftest::QuietFailures quiet;
+        CHECKIF( !"fails" );
+    } ).join();
+    CHECKIF( seen == &context && context.failed() );
+
+    // Threads not started for the test, such as a pool's, record failures
+    selftest::TestContext other( "other" );
+    bool recorded = false;
+    std::thread( [&] {
+        selftest::TestContext::Scope scope( &other );
+        recorded = selftest::TestContext::recordFailure();
+    } ).join();
+    CHECKIF( recorded && other.failed() && other.firstFailure() );
+    CHECKIF( !selftest::TestContext::recordFailure() );
+}
+
+#if defined(__cpp_impl_coroutine)
+selftest::Task<int> twice( int x )
+{
+    co_await selftest::sleepFor( std::chrono::milliseconds( 10 ) );
+    co_return 2*x;
+}
+
+TEST_ASYNC( async_sleeps )
+{
+    auto start = selftest::clock::now();
+    CHECKIF( co_await twice( 21 ) == 42 );
+    co_await selftest::sleepFor( std::chrono::hours( 1 ) );
+    CHECKIF( selftest::clock::now() - start >= std::chrono::hours( 1 ) );
+}
+
+TEST_ASYNC( async_futures )
+{
+    std::promise<int> promise;
+    std::future<int> future = promise.get_future();
+    selftest::TestThread setter( [&] {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+        promise.set_value( 7 );
+    } );
+    CHECKIF( co_await selftest::awaitFuture( future ) == 7 );
+}
+#endif
+
+TEST_FUNCTION( histogram )
+{
+    selftest::Histogram h;
+    for (std::uint64_t v = 1; v <= 100000; ++v)
+        h.record( v );
+    CHECKIF( h.count() == 100000 && h.min() == 1 && h.max() == 100000 );
+    CHECK_NEAR( h.mean(), 50000.5, 1e-6, 0. );
+    CHECK_NEAR( h.percentile( 50. ), 50000., 0., 1./256 );
+    CHECK_NEAR( h.percentile( 99.9 ), 99900., 0., 1./256 );
+    CHECKIF( h.percentile( 100. ) == 100000 );
+
+    // The ends are exact, not the middle of their buckets
+    selftest::Histogram ends;
+    std::uint64_t low = selftest::Histogram::bucketLow( selftest::Histogram::bucketOf( 1000000 ) );
+    std::uint64_t high = selftest::Histogram::bucketHigh( selftest::Histogram::bucketOf( 2000000 ) );
+    ends.record( low );
+    ends.record( high );
+    CHECKIF( ends.percentile( 0. ) == low && ends.percentile( 100. ) == high );
+
+    for (std::uint64_t v : { 0ull, 255ull, 256ull, 1000000007ull, ~0ull }) {
+        std::size_t b = selftest::Histogram::bucketOf( v );
+        CHECKIF( b < selftest::Histogram::numBuckets );
+        CHECKIF( selftest::Histogram::bucketLow( b ) <= v );
+        CHECKIF( selftest::Histogram::bucketHigh( b ) >= v );
+    }
+}
+
+TEST_FUNCTION( histogram_sharing )
+{
+    selftest::SharedHistogram shared;
+    selftest::Histogram expected;
+    {
+        std::vector<selftest::TestThread> threads;
+        for (std::uint64_t t = 0; t < 4; ++t) {
+            for (std::uint64_t v = 0; v < 1000; ++v)
+                expected.record( v*v*t );
+            threads.emplace_back( [&shared, t] {
+                for (std::uint64_t v = 0; v < 1000; ++v)
+                    shared.record( v*v*t );
+            } );
+        }
+    }
+    selftest::Histogram total = shared.snapshot();
+    CHECKIF( total == expected );
+
+    selftest::Histogram twice = total;
+    twice += total;
+    CHECKIF( twice.count() == 8000 && twice.max() == total.max() );
+
+    std::string text = total.toBase64();
+    CHECKIF( text.size() < 4000 );
+    CHECKIF( selftest::Histogram::fromBase64( text ) == total );
+    CHECKIF( selftest::decodeBase64( selftest::encodeBase64( "ab" ) ) == "ab" );
+    CHECKIFTHROWS( selftest::Histogram::fromBase64( "AQg*" ), std::invalid_argument );
+}
+
+TEST_FUNCTION( latency_checks )
+{
+    double x = 2.;
+    CHECK_LATENCY( std::sqrt( x ), 1000,
+                   p99 <= std::chrono::milliseconds( 10 ) );
+
+    using namespace selftest::latency;
+    auto slow = selftest::checkLatency( [] {
+        std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+    }, 10, { p50 <= std::chrono::microseconds( 10 ),
+             p100 <= std::chrono::seconds( 10 ) } );
+    CHECKIF( slow.exceeded.size() == 1 && slow.exceeded[0].p == 50. );
+    CHECKIF( slow.describe().find( "p50 of " ) == 2 );
+}
+
+TEST_FUNCTION( benchmark_clock )
+{
+    selftest::BenchClock::calibrate();
+    CHECKIF( selftest::BenchClock::nanosPerTick() > 0. );
+    CHECKIF( selftest::BenchClock::overheadTicks() >= 0. );
+    CHECKIF( !selftest::BenchClock::describe().empty() );
+
+    std::uint64_t start = selftest::BenchClock::start();
+    std::this_thread::sleep_for( std::chrono::milliseconds( 2 ) );
+    double nanos = double( selftest::BenchClock::stop() - start ) *
+                   selftest::BenchClock::nanosPerTick();
+    CHECKIF( nanos >= 1.9e6 && nanos < 1e9 );
+}
+
+TEST_FUNCTION( benchmark_runs )
+{
+    std::vector<uint32_t> data( 100, 0x12345678 );
+    selftest::Benchmark b( "sum", 0.01 );
+    b.run( [&] {
+        uint32_t sum = 0;
+        for (auto d : data)
+            sum += popcount_swar( d );
+        return sum;
+    } );
+    CHECKIF( b.iterations() > 0 && b.samples().count() > 0 );
+    CHECKIF( b.nanosPerOp() > 0. );
+    CHECKIF( b.describe().find( "sum " ) == 0 );
+}
+
+TEST_FUNCTION( benchmark_counters )
+{
+    std::vector<uint32_t> data( 100, 0x12345678 );
+    data[0] = 1;                    // So every sum is odd
+    selftest::Benchmark b( "counted_sum", 0.01 );
+    b.setBytesProcessed( double( data.size()*sizeof data[0] ) );
+    b.setItemsProcessed( double( data.size() ) );
+    double& odd = b.counter( "odd" );
+    b.run( [&] {
+        uint32_t sum = 0;
+        for (auto d : data)
+            sum += d;
+        odd += sum & 1;
+        return sum;
+    } );
+    CHECKIF( b.calls() >= b.iterations() );
+    CHECKIF( b.bytesProcessed() == 400. && b.itemsProcessed() == 100. );
+    CHECKIF( b.counters().size() == 1 && b.counters().at( "odd" ) == double( b.calls() ) );
+    std::string throughput = b.describeThroughput();
+    CHECKIF( throughput.find( "odd 1/op " ) != std::string::npos );
+    CHECKIF( throughput.find( " items/s" ) != std::string::npos );
+}
+
+TEST_FUNCTION( benchmark_setup )
+{
+    std::uint64_t made = 0;
+    selftest::Benchmark b( "sort", 0.01 );
+    b.run( [&] {
+               ++made;
+               std::vector<uint32_t> v( 64 );
+               for (auto& x : v)
+                   x = uint32_t( selftest::testRng().next() );
+               return v;
+           },
+           []( std::vector<uint32_t>& v ) {
+               std::sort( v.begin(), v.end() );
+               return v[0];
+           } );
+    CHECKIF( made == b.calls() && b.iterations() > 0 );
+
+    // A slow setup counts toward the time, not just the op
+    selftest::Benchmark slow( "slow_setup", 0.01 );
+    auto started = std::chrono::steady_clock::now();
+    slow.run( [] {
+                  std::this_thread::sleep_for( std::chrono::microseconds( 200 ) );
+                  return 1;
+              },
+              []( int& x ) { return x+1; } );
+    CHECKIF( std::chrono::steady_clock::now()-started < std::chrono::seconds( 2 ) );
+    CHECKIF( slow.iterations() > 0 );
+
+    // Time paused is left out
+    selftest::Benchmark paused( "paused", 0.01 );
+    paused.run( [&] {
+        paused.pauseTiming();
+        std::this_thread::sleep_for( std::chrono::microseconds( 20 ) );
+        paused.resumeTiming();
+    } );
+    CHECKIF( paused.nanosPerOp() < 10000. );
+}
+
+TEST_FUNCTION( benchmark_allocations )
+{
+    CHECKIF( selftest::trackingAllocations() );
+    selftest::AllocationCounts before = selftest::allocationCounts();
+    std::unique_ptr<std::vector<char>> kept( new std::vector<char>( 1000 ) );
+    selftest::AllocationCounts after = selftest::allocationCounts();
+    CHECKIF( after.allocations == before.allocations+2 );
+    CHECKIF( after.liveBytes - before.liveBytes == std::int64_t( 1000+sizeof *kept ) );
+    kept.reset();
+    CHECKIF( selftest::allocationCounts().liveBytes == before.liveBytes );
+
+    // Allocations by setup are not counted
+    selftest::Benchmark b( "allocating", 0.01 );
+    b.run( [] { return std::vector<int>( 100 ); },
+           []( std::vector<int>& v ) {
+               std::vector<int> copy( v );
+               return copy.size();
+           } );
+    CHECKIF( b.allocationsPerOp() == 1. );
+    CHECKIF( b.allocatedBytesPerOp() == 400. );
+    CHECKIF( b.peakBytes() == 400 );
+
+    // Nor are those while paused
+    selftest::Benchmark paused( "allocating_paused", 0.01 );
+    paused.run( [&] {
+        paused.pauseTiming();
+        std::unique_ptr<int> p( new int( 1 ) );
+        paused.resumeTiming();
+        return *p;
+    } );
+    CHECKIF( paused.allocationsPerOp() == 0. && paused.allocatedBytesPerOp() == 0. );
+}
+
+TEST_FUNCTION( benchmark_cold_cache )
+{
+    std::vector<uint32_t> data( 4096, 0x12345678 );
+    selftest::Benchmark b( "cold_sum", 0.01 );
+    b.coldCache( true );
+    b.coldInput( data.data(), data.size()*sizeof data[0] );
+    b.run( [&] {
+        uint32_t sum = 0;
+        for (auto d : data)
+            sum += d;
+        return sum;
+    } );
+    CHECKIF( b.coldSamples().count() >= selftest::Benchmark::minColdSamples );
+    CHECKIF( b.describeCold().find( "  cold " ) == 0 );
+    CHECKIF( selftest::lastLevelCacheSize() >= 64*1024 );
+}
+
+TEST_FUNCTION( benchmark_comparison )
+{
+    std::stringstream report;
+    selftest::FailRatio rc;
+    {
+        selftest::CaptureReports capture( report );
+        rc = selftest::compareBenchmarks( "popcount_by_loop", "popcount_by_swar", .02 );
+    }
+    CHECKIF( rc.numTests == 1 && rc.numFailedTests == 0 );
+    CHECKIF( report.str().find( "popcount_by_swar vs popcount_by_loop: " ) != std::string::npos );
+    CHECKIF( report.str().find( "% time per call" ) != std::string::npos );
+#if defined(__linux__)
+    CHECKIF( report.str().find( " on CPU " ) != std::string::npos );
+#endif
+}
+
+TEST_FUNCTION( benchmark_environment )
+{
+    const selftest::Environment& env = selftest::environment();
+    CHECKIF( &env == &selftest::environment() );
+    CHECKIF( !env.describe().empty() && !env.compiler.empty() );
+    selftest::Environment other = env;
+    other.loadAverage += 1.;
+    CHECKIF( other.fingerprint() == env.fingerprint() );
+    other.governor += "x";
+    CHECKIF( other.fingerprint() != env.fingerprint() );
+
+    selftest::Histogram steady, spread;
+    for (std::uint64_t i = 0; i < 100; ++i) {
+        steady.record( 1000 );
+        spread.record( 1000 + 10*i );
+    }
+    CHECKIF( selftest::Benchmark::noiseOf( steady ) == 0. );
+    CHECKIF( selftest::Benchmark::noiseOf( spread ) > .5 );
+#if defined(__linux__)
+    // Pin to a CPU this process may run on, which need not include 0
+    cpu_set_t allowed;
+    CHECKIF( sched_getaffinity( 0, sizeof allowed, &allowed ) == 0 );
+    int cpu = 0;
+    while (cpu < CPU_SETSIZE && !CPU_ISSET( cpu, &allowed ))
+        ++cpu;
+    {
+        selftest::PinToCpu pin( cpu );
+        CHECKIF( pin.cpu() == cpu );
+    }
+    cpu_set_t after;
+    CHECKIF( sched_getaffinity( 0, sizeof after, &after ) == 0 );
+    CHECKIF( CPU_EQUAL( &after, &allowed ) );
+#else
+    {
+        selftest::PinToCpu pin( 0 );
+    }
+#endif
+}
+
+TEMPLATE_TEST( template_sums, int, double, std::uint64_t )
+{
+    std::vector<TestType> values( 10, TestType( 2 ) );
+    CHECKIF( std::accumulate( values.begin(), values.end(), TestType() ) == TestType( 20 ) );
+}
+
+TEST_FUNCTION( template_names )
+{
+    CHECKSTREQ( selftest::typeName( typeid( int ) ), "int" );
+    CHECKSTREQ( selftest::typeName( typeid( std::vector<std::vector<std::string>> ) ),
+                "std::vector<std::vector<std::string>>" );
+    CHECKSTREQ( selftest::typeName( typeid( std::map<std::string, int> ) ),
+                "std::map<std::string, int>" );
+    // Arguments other than the defaults are kept, or types would share a name
+    CHECKSTREQ( selftest::typeName( typeid( std::set<long, std::less<int>> ) ),
+                "std::set<long, std::less<int>>" );
+    CHECKSTREQ( selftest::typeName( typeid( std::map<int, int, std::greater<int>> ) ),
+                "std::map<int, int, std::greater<int>>" );
+    auto names = selftest::instanceNames( "fill", { &typeid( int ), &typeid( double ) } );
+    CHECKIF( names.size() == 2 );
+    CHECKSTREQ( names[1], "fill<double>" );
+
+    selftest::Benchmark b( "sizes", 0.01 );
+    CHECKIF( b.workloadSize() == 0 );
+    CHECKIF( b.workloadSize( { 16, 1024 } ) == 16 );
+    CHECKSTREQ( b.name(), "sizes/16" );
+}
+
+TEMPLATE_BENCHMARK( fill_and_sum, std::vector<uint32_t>, std::deque<uint32_t> )
+    ( selftest::Benchmark& b )
+{
+    std::size_t n = b.workloadSize( { 16, 4096 } );
+    b.run( [&] {
+        BenchType c( n, 1 );
+        return std::accumulate( c.begin(), c.end(), uint32_t( 0 ) );
+    } );
+}
+
+BENCHMARK( popcount_by_loop )( selftest::Benchmark& b )
+{
+    uint32_t x = 0x12345678;
+    b.run( [&] { return popcount_loop( x++ ); } );
+}
+
+BENCHMARK( popcount_by_swar )( selftest::Benchmark& b )
+{
+    uint32_t x = 0x12345678;
+    b.setItemsProcessed( 1 );
+    b.run( [&] { return popcount_swar( x++ ); } );
+}
+
 TEST_FUNCTION( multiple_failures )
 {
     bool continues_after_failure = false;
@@ -66,8 +905,17 @@ TEST_FUNCTION( fourth_intentional_failure )
 
 TEST_FUNCTION( fifth_and_final_intentional_failure )
 {
-    sleep_for( seconds(3) );
+    // Virtual time counts toward the time limit, without the wait
+    selftest::clock::sleep_for( seconds(3) );
 }
 
 } // anon namespace
 
+
+// Whether parallel_suite's SUITE_TEARDOWN ran after each setup, which main()
+// asks once every test has finished, whatever order they ran in
+bool parallelSuiteToreDown()
+{
+    return parallel_suite::teardowns >= 1 &&
+           parallel_suite::teardowns == parallel_suite::setups;
+}